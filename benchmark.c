@@ -0,0 +1,563 @@
+// Benchmark suite, times parsing, compilation, program creation, every evaluation backend and
+// full renders for the graph corpus and for random expression trees of growing size.
+// Every measurement is warmed up and repeated, results are written as JSON
+
+#define main plotter_main
+#include "plotter.c"
+#undef main
+
+#include <stdint.h>
+#include <fcntl.h>
+
+int repetitions = 10;
+int warmup = 2;
+// minimum length of one timed sample, iterations are batched until it is reached
+double sample_ns = 20e6;
+// evaluations per timed iteration of the evaluation benchmarks
+uint points = 4096;
+int render_w = 512;
+int render_h = 512;
+int max_depth_random = 8;
+uint64_t seed = 1;
+
+typedef void (*BenchmarkTask)(void *context);
+
+// ns per operation over the samples with the 95% confidence interval of the mean
+typedef struct {
+    double mean;
+    double stddev;
+    double lo;
+    double hi;
+    uint samples;
+    unsigned long iterations;
+} Measurement;
+
+double Benchmark_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Two sided 95% quantile of Student's t distribution
+double Benchmark_t95(uint freedom) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    return freedom == 0 ? INFINITY : freedom <= ARRLEN(table) ? table[freedom - 1] : 1.96;
+}
+
+// Times task, which performs operations operations per call
+Measurement Benchmark_measure(BenchmarkTask task, void *context, double operations) {
+    // double the calls per sample until one takes sample_ns, this doubles as the first warmup
+    unsigned long iterations = 1;
+    for (;;) {
+        const double begin = Benchmark_now();
+        for (unsigned long i = 0; i < iterations; i++) {
+            task(context);
+        }
+        if (Benchmark_now() - begin >= sample_ns || iterations >= 1ul << 30) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    for (int w = 0; w < warmup; w++) {
+        for (unsigned long i = 0; i < iterations; i++) {
+            task(context);
+        }
+    }
+
+    double *samples = malloc(sizeof(double) * repetitions);
+    double sum = 0;
+    for (int r = 0; r < repetitions; r++) {
+        const double begin = Benchmark_now();
+        for (unsigned long i = 0; i < iterations; i++) {
+            task(context);
+        }
+        samples[r] = (Benchmark_now() - begin) / (iterations * operations);
+        sum += samples[r];
+    }
+
+    Measurement m;
+    m.samples = repetitions;
+    m.iterations = iterations;
+    m.mean = sum / repetitions;
+    double squares = 0;
+    for (int r = 0; r < repetitions; r++) {
+        squares += (samples[r] - m.mean) * (samples[r] - m.mean);
+    }
+    m.stddev = repetitions > 1 ? sqrt(squares / (repetitions - 1)) : 0;
+    const double margin = repetitions > 1 ? Benchmark_t95(repetitions - 1) * m.stddev / sqrt(repetitions) : 0;
+    m.lo = m.mean - margin;
+    m.hi = m.mean + margin;
+    free(samples);
+    return m;
+}
+
+// One expression and everything the stages being timed need
+typedef struct {
+    const char *name;
+    char *source;
+    enum PlotType type;
+    uint nodes;
+    // owns the expression and its compiled tree
+    Arena arena;
+    Expression expression;
+    State state;
+    CompilationResult compiled;
+    Evaluator evaluator;
+    Value *xs;
+    Value *ys;
+    Value *out;
+    Value sink;
+} BenchmarkCase;
+
+void BenchmarkCase_parse(void *vthis) {
+    BenchmarkCase *this = vthis;
+    char *cursor = this->source;
+    Arena arena;
+    Arena_init(&arena);
+    parseExpression(&cursor, &arena);
+    Arena_free(&arena);
+}
+
+void BenchmarkCase_compile(void *vthis) {
+    BenchmarkCase *this = vthis;
+    Arena arena;
+    Arena_init(&arena);
+    CompilationContext ctx = { &this->state, &arena };
+    compileExpression(this->expression, ctx);
+    Arena_free(&arena);
+}
+
+void BenchmarkCase_create(void *vthis) {
+    BenchmarkCase *this = vthis;
+    Program_free(Program_create(this->compiled));
+}
+
+void BenchmarkCase_scalar(void *vthis) {
+    BenchmarkCase *this = vthis;
+    Evaluator *ev = &this->evaluator;
+    Value sum = 0;
+    for (uint i = 0; i < points; i++) {
+        *ev->xp = this->xs[i];
+        *ev->yp = this->ys[i];
+        sum += Evaluator_evaluate(ev);
+    }
+    this->sink += sum;
+}
+
+void BenchmarkCase_batch(void *vthis) {
+    BenchmarkCase *this = vthis;
+    Evaluator_evaluate_batch(&this->evaluator, this->xs, this->ys, this->out, points);
+    this->sink += this->out[points - 1];
+}
+
+// Prepares and renders the whole image in one band like plotter does, log output is dropped
+void BenchmarkCase_render(void *vthis) {
+    BenchmarkCase *this = vthis;
+    fflush(stderr);
+    const int saved = dup(2);
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, 2);
+
+    Plot plot;
+    if (Plot_init(&plot, this->type, this->source, render_w, render_h)) {
+        Band band = { malloc(sizeof(BMP_color) * render_w * render_h), sizeof(BMP_color) * render_w, render_w, render_h, 0, render_h };
+        render_band(&band, &plot, 1);
+        this->sink += band.pixels[0].red;
+        free(band.pixels);
+        Plot_destroy(&plot);
+    }
+
+    fflush(stderr);
+    dup2(saved, 2);
+    close(saved);
+    close(null);
+}
+
+void json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+// Measures task and writes it as one entry of the results of the current case
+void Benchmark_report(FILE *json, int *first, const BenchmarkCase *c, const char *stage, BenchmarkTask task, void *context, double operations, const char *unit) {
+    Measurement m = Benchmark_measure(task, context, operations);
+    fprintf(stderr, "%-16s %-20s %12.2f %s/%s +- %.2f\n", c->name, stage, m.mean, "ns", unit, (m.hi - m.lo) / 2);
+    fprintf(json, "%s\n        { \"stage\": ", *first ? "" : ",");
+    json_string(json, stage);
+    fprintf(json, ", \"unit\": \"ns/%s\", \"mean\": %.4f, \"stddev\": %.4f, \"ci95\": [%.4f, %.4f], \"samples\": %u, \"iterations\": %lu }",
+        unit, m.mean, m.stddev, m.lo, m.hi, m.samples, m.iterations);
+    *first = 0;
+}
+
+const struct {
+    const char *stage;
+    enum Backend backend;
+    int batch;
+} benchmark_backends[] = {
+    { "interpreter", BACKEND_INTERPRETER, 0 },
+    { "compiled", BACKEND_COMPILED, 0 },
+    { "jit", BACKEND_JIT, 0 },
+    { "cc", BACKEND_CC, 0 },
+    { "batch", BACKEND_BATCH, 1 },
+    { "cc batch", BACKEND_CC, 1 },
+};
+
+// Runs every stage on source and writes its JSON object, BENCHMARK cases are not rendered.
+// Returns 0 if source doesn't parse
+int Benchmark_case(FILE *json, int first_case, const char *name, const char *source, enum PlotType type, uint nodes) {
+    BenchmarkCase c;
+    memset(&c, 0, sizeof(BenchmarkCase));
+    c.name = name;
+    c.source = strdup(source);
+    c.type = type;
+    c.nodes = nodes;
+
+    char *cursor = c.source;
+    Arena_init(&c.arena);
+    ParserResult result = parseExpression(&cursor, &c.arena);
+    if (result.error) {
+        fprintf(stderr, "%s: parser error: %s\n", name, result.error);
+        free(result.error);
+        Arena_free(&c.arena);
+        free(c.source);
+        return 0;
+    }
+    c.expression = result.expression;
+
+    State_init(&c.state);
+    c.state.vars['x'].occupied = 1;
+    c.state.vars['y'].occupied = 1;
+
+    // points on a square grid around the origin
+    const uint side = (uint)sqrt(points);
+    c.xs = malloc(sizeof(Value) * points * 3);
+    c.ys = c.xs + points;
+    c.out = c.ys + points;
+    for (uint i = 0; i < points; i++) {
+        c.xs[i] = ((double)(i % side) / side - 0.5) * 4;
+        c.ys[i] = ((double)(i / side % side) / side - 0.5) * 4;
+    }
+
+    CompilationContext ctx = { &c.state, &c.arena };
+    c.compiled = compileExpression(c.expression, ctx);
+
+    fprintf(json, "%s\n    {\n      \"name\": ", first_case ? "" : ",");
+    json_string(json, name);
+    fprintf(json, ",\n      \"source\": ");
+    json_string(json, source);
+    if (nodes) {
+        fprintf(json, ",\n      \"nodes\": %u", nodes);
+    }
+    if (!c.compiled.error) {
+        Program *program = Program_create(c.compiled);
+        fprintf(json, ",\n      \"instructions\": %u,\n      \"registers\": %u", program->code_length - 1, program->register_count);
+        Program_free(program);
+    }
+    fprintf(json, ",\n      \"results\": [");
+
+    int first = 1;
+    Benchmark_report(json, &first, &c, "parse", BenchmarkCase_parse, &c, 1, "op");
+    if (!c.compiled.error) {
+        Benchmark_report(json, &first, &c, "compile", BenchmarkCase_compile, &c, 1, "op");
+        Benchmark_report(json, &first, &c, "create", BenchmarkCase_create, &c, 1, "op");
+    }
+
+    for (uint i = 0; i < ARRLEN(benchmark_backends); i++) {
+        char *error = Evaluator_init(&c.evaluator, c.expression, benchmark_backends[i].backend, NULL);
+        if (error) {
+            free(error);
+            break;
+        }
+        // backends that fell back are skipped rather than measured under the wrong name
+        if (c.evaluator.backend == benchmark_backends[i].backend) {
+            Benchmark_report(json, &first, &c, benchmark_backends[i].stage,
+                benchmark_backends[i].batch ? BenchmarkCase_batch : BenchmarkCase_scalar, &c, points, "eval");
+        }
+        Evaluator_destroy(&c.evaluator);
+    }
+
+    if (type != BENCHMARK) {
+        Benchmark_report(json, &first, &c, "render", BenchmarkCase_render, &c, 1, "image");
+    }
+    fprintf(json, "\n      ]\n    }");
+    fflush(json);
+
+    free(c.compiled.error);
+    Arena_free(&c.arena);
+    free(c.xs);
+    free(c.source);
+    return 1;
+}
+
+uint64_t random_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Writes a random expression of x and y, calls have up to width arguments and the tree is
+// depth calls deep. Returns the number of nodes
+uint random_tree(FILE *out, uint64_t *state, uint depth, uint width) {
+    static const char *variadic[] = { "add", "sub", "mul", "max", "min" };
+    static const char *unary[] = { "sin", "cos", "sqrt", "abs", "tanh" };
+
+    if (depth == 0) {
+        switch (random_next(state) % 3) {
+            case 0:
+                fprintf(out, "x");
+                break;
+            case 1:
+                fprintf(out, "y");
+                break;
+            default:
+                fprintf(out, "%.3f", (double)(random_next(state) % 4001) / 1000 - 2);
+        }
+        return 1;
+    }
+
+    uint nodes = 1;
+    switch (random_next(state) % 4) {
+        case 0:
+            fprintf(out, "(%s ", unary[random_next(state) % ARRLEN(unary)]);
+            nodes += random_tree(out, state, depth - 1, width);
+            break;
+        case 1:
+            fprintf(out, "(div ");
+            nodes += random_tree(out, state, depth - 1, width);
+            fprintf(out, " ");
+            nodes += random_tree(out, state, depth - 1, width);
+            break;
+        default:
+            fprintf(out, "(%s", variadic[random_next(state) % ARRLEN(variadic)]);
+            for (uint i = 0; i < width; i++) {
+                fprintf(out, " ");
+                nodes += random_tree(out, state, depth - 1, width);
+            }
+    }
+    fprintf(out, ")");
+    return nodes;
+}
+
+// Benchmarks the NAME="source" lines of a graphs file, BENCH_ entries repeat graphs and are skipped
+int Benchmark_corpus(FILE *json, const char *path, int *first) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 0;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+        char *equals = strchr(line, '=');
+        char *end = strrchr(line, '"');
+        if (equals == NULL || equals[1] != '"' || end <= equals + 1 || strncmp(line, "BENCH_", 6) == 0) {
+            continue;
+        }
+        *equals = '\0';
+        *end = '\0';
+        char *source = equals + 2;
+
+        enum PlotType type = FUNCTION;
+        if (source[0] && source[1] == '=') {
+            type = source[0] == 'E' ? EQUATION : source[0] == 'C' ? CONTOUR : source[0] == 'B' ? BENCHMARK : FUNCTION;
+            source += 2;
+        }
+        if (Benchmark_case(json, *first, line, source, type, 0)) {
+            *first = 0;
+        }
+    }
+
+    fclose(in);
+    return 1;
+}
+
+void Benchmark_random(FILE *json, int *first) {
+    uint64_t state = seed ? seed : 1;
+    for (uint width = 2; width <= 3; width++) {
+        for (uint depth = 2; depth <= (uint)max_depth_random; depth += 2) {
+            char *text = NULL;
+            size_t length = 0;
+            FILE *out = open_memstream(&text, &length);
+            const uint nodes = random_tree(out, &state, depth, width);
+            fclose(out);
+
+            char name[64];
+            sprintf(name, "random_d%u_w%u", depth, width);
+            // only evaluated, rendering them says little beyond what the corpus does
+            if (Benchmark_case(json, *first, name, text, BENCHMARK, nodes)) {
+                *first = 0;
+            }
+            free(text);
+        }
+    }
+}
+
+// Instructions the program of source compiles to and nodes of its simplified tree, both 0 if it
+// doesn't compile
+void Benchmark_instructions(const char *source, uint *instructions, uint *nodes) {
+    char *text = strdup(source);
+    char *cursor = text;
+    Arena arena;
+    Arena_init(&arena);
+    State state;
+    State_init(&state);
+    state.vars['x'].occupied = 1;
+    state.vars['y'].occupied = 1;
+
+    *instructions = 0;
+    *nodes = 0;
+    ParserResult result = parseExpression(&cursor, &arena);
+    if (result.error) {
+        free(result.error);
+    } else {
+        CompilationContext ctx = { &state, &arena };
+        Expression reduced = Expression_reduce(result.expression, ctx);
+        CompilationResult compiled = compileTree(reduced, ctx);
+        if (compiled.error) {
+            free(compiled.error);
+        } else {
+            Program *program = Program_create(compiled);
+            *instructions = program->code_length - 1;
+            *nodes = Expression_size(reduced);
+            Program_free(program);
+        }
+    }
+    Arena_free(&arena);
+    free(text);
+}
+
+// Checks that integer powers compile to repeated squaring, and that nested powers grow
+// linearly with their depth both in instructions and in the nodes every tree walk visits.
+// Returns 0 if any count is off
+int Benchmark_check() {
+    static const struct {
+        const char *source;
+        uint instructions;
+    } powers[] = {
+        { "(pow x 8)", 3 },
+        { "(pow x 16)", 4 },
+        { "(pow x 15)", 6 },
+        { "(pow x -16)", 5 },
+        { "(pow (pow (pow (pow x 3) 3) 3) 3)", 8 },
+    };
+    int ok = 1;
+    uint instructions, nodes;
+    for (uint i = 0; i < ARRLEN(powers); i++) {
+        Benchmark_instructions(powers[i].source, &instructions, &nodes);
+        if (instructions != powers[i].instructions) {
+            fprintf(stderr, "%s compiled to %u instructions, expected %u\n", powers[i].source, instructions, powers[i].instructions);
+            ok = 0;
+        }
+    }
+
+    static const uint exponents[] = { 3, 15, 16 };
+    for (uint i = 0; i < ARRLEN(exponents); i++) {
+        char source[1024] = "x";
+        uint single = 0;
+        for (uint depth = 1; depth <= 10; depth++) {
+            char inner[1024];
+            strcpy(inner, source);
+            sprintf(source, "(pow %s %u)", inner, exponents[i]);
+            Benchmark_instructions(source, &instructions, &nodes);
+            single = depth == 1 ? instructions : single;
+            if (instructions == 0 || instructions > single * depth || nodes > (CALL_REDUCE_MAX_POW_NODES + 2) * depth) {
+                fprintf(stderr, "%s compiled to %u instructions from %u nodes, expected at most %u from %u\n",
+                    source, instructions, nodes, single * depth, (CALL_REDUCE_MAX_POW_NODES + 2) * depth);
+                ok = 0;
+            }
+        }
+    }
+    fprintf(stderr, ok ? "Instruction counts are as expected\n" : "Instruction counts are off\n");
+    return ok;
+}
+
+void benchmark_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n repetitions] [-w warmup samples] [-m sample milliseconds] [-p points] [-s width x height] [-d random tree depth] [-r seed] [-k auto/avx2/sse2/scalar] [-t threads] [-o output json] [-c] [graphs file]\n", name);
+}
+
+int main(int argc, const char **argv) {
+    const char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, (char* const*)argv, "n:w:m:p:s:d:r:k:t:o:c")) != -1) {
+        switch (opt) {
+            case 'n':
+                repetitions = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 'm':
+                sample_ns = atof(optarg) * 1e6;
+                break;
+            case 'p':
+                points = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &render_w, &render_h) != 2 || render_w <= 0 || render_h <= 0) {
+                    fprintf(stderr, "Invalid size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                max_depth_random = atoi(optarg);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                if (!Vector_select(optarg)) {
+                    fprintf(stderr, "Vector kernels '%s' are unknown or not supported\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'c':
+                return Benchmark_check() ? 0 : 1;
+            default:
+                benchmark_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (repetitions < 1 || points < 1) {
+        benchmark_usage(argv[0]);
+        return 1;
+    }
+
+    FILE *json = output ? fopen(output, "w") : stdout;
+    if (json == NULL) {
+        fprintf(stderr, "Failed to open %s\n", output);
+        return 1;
+    }
+
+    fprintf(json, "{\n  \"config\": { \"repetitions\": %d, \"warmup\": %d, \"sample_ms\": %.1f, \"points\": %u, \"render\": [%d, %d], \"kernels\": \"%s\", \"threads\": %u },\n  \"cases\": [",
+        repetitions, warmup, sample_ns / 1e6, points, render_w, render_h, Vector_kernels()->name, plot_threads());
+
+    int first = 1;
+    int code = Benchmark_corpus(json, optind < argc ? argv[optind] : "graphs", &first) ? 0 : 1;
+    Benchmark_random(json, &first);
+
+    fprintf(json, "\n  ]\n}\n");
+    if (output) {
+        fclose(json);
+    }
+    return code;
+}
@@ -4,6 +4,8 @@
 #include <malloc.h>
 #include <time.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #define BMP_HEADER_SIZE 0x36
 #define BMP_INFO_HEADER_SIZE 40
@@ -63,26 +65,115 @@ typedef struct {
     uint8_t blue;
 } BMP_color;
 
-void BMP_create(FILE *out, int w, int h, BMP_color *framebuffer) {
-	const char signature[2] = "BM";
+// Bytes in a row of pixels, rows are padded to a multiple of 4
+uint64_t BMP_row_size(int w) {
+	return ((uint64_t)w * BMP_BIT_DEPTH / 8 + 3) & ~(uint64_t)3;
+}
+
+// Writes an image a band of rows at a time, bottom row first
+typedef struct {
+	FILE *out;
+	int w;
+	int h;
+} BMP_writer;
+
+void BMP_fill_header(struct BMPHeader *header, int w, int h) {
 	const int data_offset = 0x36;
-	const int pixel_count = w * h;
+	uint64_t file_size = BMP_row_size(w) * h + BMP_HEADER_SIZE;
+	// the field is 32 bits wide, readers go by the dimensions when it can't hold the size
+	if (file_size > UINT32_MAX) {
+		file_size = 0;
+	}
+
+	BMP_clear_header(header);
+
+	BMP_set_header_property(header, &BMP_Signature_Property, 'B' | 'M' << 8);
+	BMP_set_header_property(header, &BMP_FileSize_Property, file_size);
+	BMP_set_header_property(header, &BMP_DataOffset_Property, data_offset);
+	BMP_set_header_property(header, &BMP_Width_Property, w);
+	BMP_set_header_property(header, &BMP_Height_Property, h);
+	BMP_set_header_property(header, &BMP_BitDepth_Property, BMP_BIT_DEPTH);
+	BMP_set_header_property(header, &BMP_InfoHeaderSize_Property, BMP_INFO_HEADER_SIZE);
+	BMP_set_header_property(header, &BMP_Planes_Property, 1);
+}
 
-	const int file_size = (pixel_count * BMP_BIT_DEPTH) / 8 + BMP_HEADER_SIZE;
+void BMP_begin(BMP_writer *this, FILE *out, int w, int h) {
 	struct BMPHeader header;
+	BMP_fill_header(&header, w, h);
+	BMP_write_header(&header, out);
 
-	BMP_clear_header(&header);
+	this->out = out;
+	this->w = w;
+	this->h = h;
+}
 
-	BMP_set_header_property(&header, &BMP_Signature_Property, *(long int*)signature);
-	BMP_set_header_property(&header, &BMP_FileSize_Property, file_size);
-	BMP_set_header_property(&header, &BMP_DataOffset_Property, data_offset);
-	BMP_set_header_property(&header, &BMP_Width_Property, w);
-	BMP_set_header_property(&header, &BMP_Height_Property, h);
-	BMP_set_header_property(&header, &BMP_BitDepth_Property, BMP_BIT_DEPTH);
-	BMP_set_header_property(&header, &BMP_InfoHeaderSize_Property, BMP_INFO_HEADER_SIZE);
-	BMP_set_header_property(&header, &BMP_Planes_Property, 1);
+// Writes count rows of w pixels, returns 0 if writing failed
+int BMP_write_rows(BMP_writer *this, const BMP_color *rows, int count) {
+	const size_t width = (size_t)this->w * sizeof(BMP_color);
+	const size_t padding = BMP_row_size(this->w) - width;
+	if (padding == 0) {
+		return fwrite(rows, width, count, this->out) == (size_t)count;
+	}
+
+	const char zeros[4] = { 0 };
+	for (int y = 0; y < count; y++) {
+		if (fwrite(rows + (size_t)y * this->w, 1, width, this->out) != width || fwrite(zeros, 1, padding, this->out) != padding) {
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	BMP_write_header(&header, out);
+void BMP_create(FILE *out, int w, int h, BMP_color *framebuffer) {
+	BMP_writer writer;
+	BMP_begin(&writer, out, w, h);
+	BMP_write_rows(&writer, framebuffer, h);
+}
+
+// Pixels of a bmp file mapped into memory, row y starts stride bytes after row y - 1
+typedef struct {
+	char *data;
+	size_t length;
+	size_t stride;
+	BMP_color *pixels;
+} BMP_mapping;
+
+// Grows the file to its final size, maps it and writes the header. Returns 0 if the file
+// can't be mapped, out may have been resized but nothing is written to it then
+int BMP_map(BMP_mapping *this, FILE *out, int w, int h) {
+	const int fd = fileno(out);
+	this->stride = BMP_row_size(w);
+	this->length = this->stride * h + BMP_HEADER_SIZE;
+	if (ftruncate(fd, this->length) != 0) {
+		return 0;
+	}
+
+	this->data = mmap(NULL, this->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (this->data == MAP_FAILED) {
+		return 0;
+	}
+	this->pixels = (BMP_color*)(this->data + BMP_HEADER_SIZE);
+
+	struct BMPHeader header;
+	BMP_fill_header(&header, w, h);
+	memcpy(this->data, header.data, BMP_HEADER_SIZE);
 
-    fwrite(framebuffer, sizeof(BMP_color), w * h, out);
-}
\ No newline at end of file
+	// rows are drawn in bands whose tiles touch rows in no particular order, readahead of
+	// the empty file would only waste page cache
+	madvise(this->data, this->length, MADV_RANDOM);
+	return 1;
+}
+
+// Applies advice to rows [y0, y0 + rows), widened to whole pages
+void BMP_advise(BMP_mapping *this, int y0, int rows, int advice) {
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t begin = (BMP_HEADER_SIZE + this->stride * y0) / page * page;
+	size_t end = BMP_HEADER_SIZE + this->stride * (y0 + rows);
+	end = end < this->length ? end : this->length;
+	madvise(this->data + begin, end - begin, advice);
+}
+
+// The page cache writes the pixels back once they are unmapped
+int BMP_unmap(BMP_mapping *this) {
+	return munmap(this->data, this->length) == 0;
+}
@@ -0,0 +1,213 @@
+// Marching squares over a grid of samples of an implicit function, the zero crossings
+// along cell edges are linearly interpolated and joined into polylines
+
+typedef struct {
+    Value x;
+    Value y;
+} ContourPoint;
+
+// Samples at the corners of columns * rows cells, corner (i, j) lies at
+// (x0 + i * dx, y0 + j * dy) and its value is values[i * (rows + 1) + j]
+typedef struct {
+    uint columns;
+    uint rows;
+    Value x0;
+    Value y0;
+    Value dx;
+    Value dy;
+    Value *values;
+} ContourGrid;
+
+// Crossings are indexed by edge, horizontal edges (i, j) to (i + 1, j) come first followed by
+// vertical edges (i, j) to (i, j + 1). edge_point is -1 for edges without a crossing.
+// Polyline k spans points[offsets[k]] up to points[offsets[k + 1]]
+typedef struct {
+    ContourGrid grid;
+    uint edge_count;
+    int *edge_point;
+    uint point_count;
+    ContourPoint *points;
+    uint *point_edge;
+
+    uint polyline_count;
+    uint *offsets;
+    ContourPoint *polylines;
+} Contours;
+
+Value ContourGrid_get(const ContourGrid *this, uint i, uint j) {
+    return this->values[i * (this->rows + 1) + j];
+}
+
+uint Contours_horizontal(const Contours *this, uint i, uint j) {
+    return j * this->grid.columns + i;
+}
+
+uint Contours_vertical(const Contours *this, uint i, uint j) {
+    return (this->grid.rows + 1) * this->grid.columns + i * this->grid.rows + j;
+}
+
+void Contours_cross(Contours *this, uint edge, Value x0, Value y0, Value a, Value x1, Value y1, Value b) {
+    if ((a < 0) == (b < 0) || isnan(a) || isnan(b)) {
+        return;
+    }
+
+    const Value t = a / (a - b);
+    ContourPoint point = { x0 + (x1 - x0) * t, y0 + (y1 - y0) * t };
+    this->edge_point[edge] = this->point_count;
+    this->point_edge[this->point_count] = edge;
+    this->points[this->point_count++] = point;
+}
+
+// Finds the interpolated zero crossing on every edge whose ends differ in sign
+void Contours_init(Contours *this, ContourGrid grid) {
+    this->grid = grid;
+    this->edge_count = (grid.rows + 1) * grid.columns + (grid.columns + 1) * grid.rows;
+    this->edge_point = malloc(sizeof(int) * this->edge_count);
+    this->points = malloc(sizeof(ContourPoint) * this->edge_count);
+    this->point_edge = malloc(sizeof(uint) * this->edge_count);
+    this->point_count = 0;
+    this->polyline_count = 0;
+    this->offsets = NULL;
+    this->polylines = NULL;
+
+    for (uint e = 0; e < this->edge_count; e++) {
+        this->edge_point[e] = -1;
+    }
+
+    for (uint i = 0; i <= grid.columns; i++) {
+        const Value x = grid.x0 + i * grid.dx;
+        for (uint j = 0; j <= grid.rows; j++) {
+            const Value y = grid.y0 + j * grid.dy;
+            const Value v = ContourGrid_get(&grid, i, j);
+            if (i < grid.columns) {
+                Contours_cross(this, Contours_horizontal(this, i, j), x, y, v, x + grid.dx, y, ContourGrid_get(&grid, i + 1, j));
+            }
+            if (j < grid.rows) {
+                Contours_cross(this, Contours_vertical(this, i, j), x, y, v, x, y + grid.dy, ContourGrid_get(&grid, i, j + 1));
+            }
+        }
+    }
+}
+
+void Contours_destroy(Contours *this) {
+    free(this->edge_point);
+    free(this->points);
+    free(this->point_edge);
+    free(this->offsets);
+    free(this->polylines);
+}
+
+// Smaller of the magnitudes at the ends of the edge of crossing k
+Value Contours_edge_distance(const Contours *this, uint k) {
+    const uint edge = this->point_edge[k];
+    const uint horizontal = (this->grid.rows + 1) * this->grid.columns;
+    Value a, b;
+    if (edge < horizontal) {
+        const uint i = edge % this->grid.columns;
+        const uint j = edge / this->grid.columns;
+        a = ContourGrid_get(&this->grid, i, j);
+        b = ContourGrid_get(&this->grid, i + 1, j);
+    } else {
+        const uint i = (edge - horizontal) / this->grid.rows;
+        const uint j = (edge - horizontal) % this->grid.rows;
+        a = ContourGrid_get(&this->grid, i, j);
+        b = ContourGrid_get(&this->grid, i, j + 1);
+    }
+    a = Value_fabs(a);
+    b = Value_fabs(b);
+    return a < b ? a : b;
+}
+
+// Drops crossing k, cells won't connect through its edge
+void Contours_reject(Contours *this, uint k) {
+    this->edge_point[this->point_edge[k]] = -1;
+}
+
+// Whether crossing k hasn't been rejected
+int Contours_accepted(const Contours *this, uint k) {
+    return this->edge_point[this->point_edge[k]] == (int)k;
+}
+
+void Contours_link(int *links, uint a, uint b) {
+    links[a * 2 + (links[a * 2] >= 0)] = b;
+    links[b * 2 + (links[b * 2] >= 0)] = a;
+}
+
+// Connects the crossings of every cell and joins the segments into polylines,
+// open polylines start at their ends and closed ones repeat their first point at the end
+void Contours_trace(Contours *this) {
+    const ContourGrid *grid = &this->grid;
+    int *links = malloc(sizeof(int) * this->edge_count * 2);
+    for (uint e = 0; e < this->edge_count * 2; e++) {
+        links[e] = -1;
+    }
+
+    for (uint i = 0; i < grid->columns; i++) {
+        for (uint j = 0; j < grid->rows; j++) {
+            // bottom, right, top, left
+            const uint edges[4] = {
+                Contours_horizontal(this, i, j), Contours_vertical(this, i + 1, j),
+                Contours_horizontal(this, i, j + 1), Contours_vertical(this, i, j)
+            };
+            uint crossed[4];
+            uint count = 0;
+            for (uint k = 0; k < 4; k++) {
+                if (this->edge_point[edges[k]] >= 0) {
+                    crossed[count++] = k;
+                }
+            }
+
+            if (count == 2) {
+                Contours_link(links, edges[crossed[0]], edges[crossed[1]]);
+            } else if (count == 4) {
+                // saddle, the sign of the center decides which corners are joined
+                const Value center = (ContourGrid_get(grid, i, j) + ContourGrid_get(grid, i + 1, j)
+                    + ContourGrid_get(grid, i, j + 1) + ContourGrid_get(grid, i + 1, j + 1)) * 0.25;
+                if ((center < 0) == (ContourGrid_get(grid, i, j) < 0)) {
+                    Contours_link(links, edges[0], edges[1]);
+                    Contours_link(links, edges[2], edges[3]);
+                } else {
+                    Contours_link(links, edges[0], edges[3]);
+                    Contours_link(links, edges[1], edges[2]);
+                }
+            }
+        }
+    }
+
+    char *visited = calloc(this->edge_count, 1);
+    this->offsets = malloc(sizeof(uint) * (this->point_count + 1));
+    this->polylines = malloc(sizeof(ContourPoint) * (this->point_count * 2 + 1));
+    uint length = 0;
+
+    // open chains first so they are walked from an end, then the loops that remain
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint k = 0; k < this->point_count; k++) {
+            const uint start = this->point_edge[k];
+            if (visited[start] || this->edge_point[start] < 0 || links[start * 2] < 0) {
+                continue;
+            }
+            const int open = links[start * 2 + 1] < 0;
+            if (pass == 0 && !open) {
+                continue;
+            }
+
+            this->offsets[this->polyline_count++] = length;
+            int previous = -1;
+            int edge = start;
+            while (edge >= 0 && !visited[edge]) {
+                visited[edge] = 1;
+                this->polylines[length++] = this->points[this->edge_point[edge]];
+                int next = links[edge * 2] != previous ? links[edge * 2] : links[edge * 2 + 1];
+                previous = edge;
+                edge = next;
+            }
+            if (edge == (int)start) {
+                this->polylines[length++] = this->points[this->edge_point[start]];
+            }
+        }
+    }
+    this->offsets[this->polyline_count] = length;
+
+    free(visited);
+    free(links);
+}
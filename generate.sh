@@ -1,4 +1,5 @@
-gcc -O3 plotter.c -o ./plotter
+gcc -O3 plotter.c -o ./plotter -lm -pthread -ldl
+gcc -O3 benchmark.c -o ./benchmark -lm -pthread -ldl
 
 mkdir plots
 
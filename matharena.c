@@ -0,0 +1,50 @@
+// Bump allocator owning everything a parse or compile session creates. Allocations are carved
+// out of blocks that double in size, so a session makes a handful of system allocations at most,
+// and nothing is released until the whole arena is freed
+
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *previous;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[0];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *block;
+} Arena;
+
+// The first block is only allocated once something is
+void Arena_init(Arena *this) {
+    this->block = NULL;
+}
+
+void *Arena_alloc(Arena *this, size_t size) {
+    ArenaBlock *block = this->block;
+    size_t offset = block ? (block->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : 0;
+
+    if (block == NULL || offset + size > block->size) {
+        size_t capacity = block ? block->size * 2 : ARENA_BLOCK;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        block->previous = this->block;
+        block->size = capacity;
+        this->block = block;
+        offset = 0;
+    }
+
+    block->used = offset + size;
+    return block->data + offset;
+}
+
+void Arena_free(Arena *this) {
+    while (this->block) {
+        ArenaBlock *previous = this->block->previous;
+        free(this->block);
+        this->block = previous;
+    }
+}
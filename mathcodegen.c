@@ -0,0 +1,351 @@
+// Ahead of time compilation of programs to C. Every instruction becomes one statement of a
+// straight-line function taking the variables as parameters, with constants inlined. The source
+// is built into a shared library by the system compiler and loaded with dlopen, libraries are
+// kept in a cache directory under a hash of the canonical expression so later runs reuse them
+
+#if defined(__unix__)
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define CODEGEN_VERSION "1"
+
+// libm functions called by name from generated code, others go through program_functions
+const struct {
+    void *function;
+    const char *name;
+} codegen_functions[] = {
+    { &pow, "pow" }, { &fmod, "fmod" }, { &sqrt, "sqrt" }, { &log, "log" }, { &log10, "log10" },
+    { &ceil, "ceil" }, { &floor, "floor" }, { &fabs, "fabs" },
+    { &sin, "sin" }, { &cos, "cos" }, { &tan, "tan" }, { &sinh, "sinh" }, { &cosh, "cosh" },
+    { &tanh, "tanh" }, { &asin, "asin" }, { &acos, "acos" }, { &atan, "atan" }, { &atan2, "atan2" },
+};
+
+const char *Codegen_function_name(void *function) {
+    for (uint i = 0; i < sizeof(codegen_functions) / sizeof(codegen_functions[0]); i++) {
+        if (codegen_functions[i].function == function) {
+            return codegen_functions[i].name;
+        }
+    }
+    return NULL;
+}
+
+uint64_t Codegen_hash(uint64_t hash, const char *text) {
+    for (; *text; text++) {
+        hash = (hash ^ (unsigned char)*text) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Register r as a C expression, writer holds the instruction that last wrote each temporary
+void Codegen_operand(FILE *out, const Program *program, const uint *writer, uint r) {
+    const uint fixed = program->variable_count + program->constant_count;
+    if (r < program->variable_count) {
+        fprintf(out, "v%u", r);
+    } else if (r >= fixed) {
+        fprintf(out, "t%u", writer[r - fixed]);
+    } else {
+        const Value value = program->constants[r - program->variable_count];
+        if (isnan(value)) {
+            fprintf(out, "NAN");
+        } else if (isinf(value)) {
+            fprintf(out, value < 0 ? "(-INFINITY)" : "INFINITY");
+        } else {
+            fprintf(out, "(%a)", value);
+        }
+    }
+}
+
+// Writes C source for program, calls without a libm name take the next slot of program_functions
+void Codegen_source(FILE *out, const Program *program, const char *canonical) {
+    const uint fixed = program->variable_count + program->constant_count;
+    uint *writer = malloc(sizeof(uint) * (program->register_count - fixed + 1));
+    uint slots = 0;
+
+    fprintf(out, "// %s\n#include <math.h>\n\nvoid *program_functions[%u];\n\n", canonical, program->code_length);
+
+    fprintf(out, "static inline double program_expression(");
+    for (uint i = 0; i < program->variable_count; i++) {
+        fprintf(out, "%sdouble v%u", i ? ", " : "", i);
+    }
+    fprintf(out, program->variable_count ? ") {\n" : "void) {\n");
+
+    for (uint i = 0; i < program->code_length; i++) {
+        const Instruction *in = &program->code[i];
+        if (in->op == OP_RETURN) {
+            fprintf(out, "    return ");
+            Codegen_operand(out, program, writer, in->a);
+            fprintf(out, ";\n");
+            break;
+        }
+
+        fprintf(out, "    const double t%u = ", i);
+        const char *infix = NULL;
+        switch (in->op) {
+            case OP_ADD:
+                infix = " + ";
+                break;
+            case OP_SUB:
+                infix = " - ";
+                break;
+            case OP_MUL:
+                infix = " * ";
+                break;
+            case OP_DIV:
+                infix = " / ";
+                break;
+            case OP_MAX:
+            case OP_MIN:
+                // same operand order as the VM so NaNs propagate alike
+                Codegen_operand(out, program, writer, in->b);
+                fprintf(out, in->op == OP_MAX ? " > " : " < ");
+                Codegen_operand(out, program, writer, in->a);
+                fprintf(out, " ? ");
+                Codegen_operand(out, program, writer, in->b);
+                fprintf(out, " : ");
+                Codegen_operand(out, program, writer, in->a);
+                break;
+            default:
+                const char *name = Codegen_function_name(in->function);
+                if (name) {
+                    fprintf(out, "%s(", name);
+                } else if (in->op == OP_CALL_UNARY) {
+                    fprintf(out, "((double (*)(double))program_functions[%u])(", slots);
+                } else {
+                    fprintf(out, "((double (*)(double, double))program_functions[%u])(", slots);
+                }
+                slots += !name;
+                Codegen_operand(out, program, writer, in->a);
+                if (in->op == OP_CALL_BINARY) {
+                    fprintf(out, ", ");
+                    Codegen_operand(out, program, writer, in->b);
+                }
+                fprintf(out, ")");
+        }
+        if (infix) {
+            Codegen_operand(out, program, writer, in->a);
+            fprintf(out, "%s", infix);
+            Codegen_operand(out, program, writer, in->b);
+        }
+        fprintf(out, ";\n");
+
+        writer[in->dst - fixed] = i;
+    }
+    fprintf(out, "}\n\n");
+
+    // scalar entry point, reads the variables from the register file like the VM
+    fprintf(out, "double program_native(double *r) {\n    return program_expression(");
+    for (uint i = 0; i < program->variable_count; i++) {
+        fprintf(out, "%sr[%u]", i ? ", " : "", i);
+    }
+    fprintf(out, ");\n}\n\n");
+
+    // batch entry point, inputs is indexed by register and a NULL input keeps the register's
+    // value. Each combination of inputs gets its own loop when there are few variables
+    fprintf(out, "void program_batch(const double *r, const double *const *inputs, double *out, unsigned int count) {\n");
+    const uint variants = program->variable_count <= 3 ? 1u << program->variable_count : 0;
+    for (uint mask = 0; mask < variants; mask++) {
+        fprintf(out, "    if (1");
+        for (uint i = 0; i < program->variable_count; i++) {
+            fprintf(out, mask & 1u << i ? " && inputs[%u]" : " && !inputs[%u]", i);
+        }
+        fprintf(out, ") {\n        for (unsigned int i = 0; i < count; i++) {\n            out[i] = program_expression(");
+        for (uint i = 0; i < program->variable_count; i++) {
+            fprintf(out, mask & 1u << i ? "%sinputs[%u][i]" : "%sr[%u]", i ? ", " : "", i);
+        }
+        fprintf(out, ");\n        }\n        return;\n    }\n");
+    }
+    fprintf(out, "    for (unsigned int i = 0; i < count; i++) {\n        out[i] = program_expression(");
+    for (uint i = 0; i < program->variable_count; i++) {
+        fprintf(out, "%sinputs[%u] ? inputs[%u][i] : r[%u]", i ? ", " : "", i, i, i);
+    }
+    fprintf(out, ");\n    }\n}\n");
+
+    free(writer);
+}
+
+// Fills functions with the calls that go through program_functions, returns their number
+uint Codegen_functions(const Program *program, void **functions) {
+    uint slots = 0;
+    for (uint i = 0; i < program->code_length; i++) {
+        const Instruction *in = &program->code[i];
+        if ((in->op == OP_CALL_UNARY || in->op == OP_CALL_BINARY) && !Codegen_function_name(in->function)) {
+            functions[slots++] = in->function;
+        }
+    }
+    return slots;
+}
+
+char *Codegen_error(const char *format, const char *path) {
+    char *error = malloc(strlen(format) + strlen(path) + 1);
+    sprintf(error, format, path);
+    return error;
+}
+
+// Writes the source of program to path and builds it into library
+char *Codegen_build(const Program *program, const char *canonical, const char *source, const char *library) {
+    FILE *out = fopen(source, "w");
+    if (out == NULL) {
+        return Codegen_error("Failed to write %s", source);
+    }
+    Codegen_source(out, program, canonical);
+    fclose(out);
+
+    // built under a temporary name and renamed so concurrent runs never load a partial file
+    const size_t length = strlen(library) + 32;
+    char *temporary = malloc(length);
+    snprintf(temporary, length, "%s.%ld", library, (long)getpid());
+    char *log = malloc(strlen(source) + 8);
+    sprintf(log, "%s.log", source);
+
+    // the compiler is run without a shell so paths need no quoting
+    char *command = strdup(MATH_CC " " MATH_CC_FLAGS);
+    char *args[64];
+    uint count = 0;
+    for (char *arg = strtok(command, " "); arg && count < 59; arg = strtok(NULL, " ")) {
+        args[count++] = arg;
+    }
+    args[count++] = "-o";
+    args[count++] = temporary;
+    args[count++] = (char*)source;
+    args[count++] = "-lm";
+    args[count] = NULL;
+
+    int status = -1;
+    const pid_t child = fork();
+    if (child == 0) {
+        const int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, 2);
+            close(fd);
+        }
+        execvp(args[0], args);
+        _exit(127);
+    }
+    if (child > 0 && waitpid(child, &status, 0) != child) {
+        status = -1;
+    }
+
+    char *error = NULL;
+    if (child < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || rename(temporary, library) != 0) {
+        unlink(temporary);
+        error = Codegen_error("Failed to compile %s", source);
+    } else {
+        unlink(log);
+    }
+    free(command);
+    free(log);
+    free(temporary);
+    return error;
+}
+
+char *Codegen_load(Program *program, const char *library) {
+    void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        return Codegen_error("Failed to load %s", library);
+    }
+
+    void **table = dlsym(handle, "program_functions");
+    ProgramFunction native = (ProgramFunction)dlsym(handle, "program_native");
+    ProgramBatchFunction batch = (ProgramBatchFunction)dlsym(handle, "program_batch");
+    if (table == NULL || native == NULL || batch == NULL) {
+        dlclose(handle);
+        return Codegen_error("Missing entry points in %s", library);
+    }
+    Codegen_functions(program, table);
+
+    program->native = native;
+    program->native_batch = batch;
+    program->library = handle;
+    return NULL;
+}
+
+#define CODEGEN_FEATURE(name) (__builtin_cpu_supports(name) ? '1' : '0')
+
+// What identifies the cpu, libraries are built with -march=native so a cache shared between
+// machines must not load one built for another cpu. These are the vendor, model and feature
+// lines of the first processor in /proc/cpuinfo, or the features gcc detects without it
+const char *Codegen_cpu() {
+    static char cpu[8192];
+    if (cpu[0]) {
+        return cpu;
+    }
+    FILE *in = fopen("/proc/cpuinfo", "r");
+    if (in) {
+        char *line = NULL;
+        size_t length = 0;
+        while (getline(&line, &length, in) != -1 && line[0] != '\n') {
+            if (strncmp(line, "vendor_id", 9) == 0 || strncmp(line, "model name", 10) == 0
+                    || strncmp(line, "flags", 5) == 0 || strncmp(line, "Features", 8) == 0
+                    || strncmp(line, "CPU part", 8) == 0 || strncmp(line, "isa", 3) == 0) {
+                strncat(cpu, line, sizeof(cpu) - strlen(cpu) - 1);
+            }
+        }
+        free(line);
+        fclose(in);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu[0] == '\0') {
+        __builtin_cpu_init();
+        const char features[] = {
+            CODEGEN_FEATURE("sse3"), CODEGEN_FEATURE("ssse3"), CODEGEN_FEATURE("sse4.1"),
+            CODEGEN_FEATURE("sse4.2"), CODEGEN_FEATURE("popcnt"), CODEGEN_FEATURE("avx"),
+            CODEGEN_FEATURE("avx2"), CODEGEN_FEATURE("fma"), CODEGEN_FEATURE("bmi"),
+            CODEGEN_FEATURE("bmi2"), CODEGEN_FEATURE("avx512f"), CODEGEN_FEATURE("avx512dq"),
+            CODEGEN_FEATURE("avx512bw"), CODEGEN_FEATURE("avx512vl"), '\0'
+        };
+        snprintf(cpu, sizeof(cpu), "x86 %s", features);
+    }
+#endif
+    if (cpu[0] == '\0') {
+        strcpy(cpu, "unknown");
+    }
+    return cpu;
+}
+
+// Compiles program to C and loads the result, Program_execute and Program_execute_batch run it
+// from then on. canonical identifies the program in the cache kept in directory, a library
+// already built for it is loaded without invoking the compiler
+char *Program_cc(Program *program, const char *canonical, const char *directory) {
+    uint64_t hash = Codegen_hash(0xcbf29ce484222325, CODEGEN_VERSION " " MATH_CC " " MATH_CC_FLAGS "\n");
+    hash = Codegen_hash(hash, Codegen_cpu());
+    hash = Codegen_hash(hash, canonical);
+
+    const size_t length = strlen(directory) + 32;
+    char *source = malloc(length);
+    char *library = malloc(length);
+    snprintf(source, length, "%s/%016llx.c", directory, (unsigned long long)hash);
+    snprintf(library, length, "%s/%016llx.so", directory, (unsigned long long)hash);
+
+    char *error = NULL;
+    if (access(library, R_OK) != 0) {
+        error = Codegen_build(program, canonical, source, library);
+    }
+    if (error == NULL) {
+        error = Codegen_load(program, library);
+    }
+
+    free(source);
+    free(library);
+    return error;
+}
+
+void Program_free_library(Program *program) {
+    dlclose(program->library);
+}
+
+#else
+
+char *Program_cc(Program *program, const char *canonical, const char *directory) {
+    char *error = malloc(64);
+    sprintf(error, "Shared libraries are only loaded on unix");
+    return error;
+}
+
+void Program_free_library(Program *program) {
+}
+
+#endif
@@ -5,4 +5,8 @@ typedef uint8_t VariableIndex;
 
 #define MATH_MAX_VARS UCHAR_MAX
 #define Value_fabs fabs
-typedef unsigned int uint;
\ No newline at end of file
+typedef unsigned int uint;
+
+// Compiler and flags used to build programs into shared libraries
+#define MATH_CC "cc"
+#define MATH_CC_FLAGS "-O3 -march=native -ffp-contract=off -shared -fPIC"
\ No newline at end of file
@@ -0,0 +1,151 @@
+// Dual numbers for forward mode differentiation, a value carries its partial derivatives along
+// x and y and every operation applies the chain rule, so one evaluation yields f and its
+// gradient. A term whose derivative is zero is dropped so constant operands never turn an
+// infinite partial into NaN
+
+typedef struct {
+    Value v;
+    Value dx;
+    Value dy;
+} Dual;
+
+Dual Dual_constant(Value value) {
+    Dual result = { value, 0, 0 };
+    return result;
+}
+
+Value Dual_term(Value partial, Value derivative) {
+    return derivative == 0 ? 0 : partial * derivative;
+}
+
+// value of f(a) given df/da
+Dual Dual_chain(Value value, Value partial, Dual a) {
+    Dual result = { value, Dual_term(partial, a.dx), Dual_term(partial, a.dy) };
+    return result;
+}
+
+// value of f(a, b) given df/da and df/db
+Dual Dual_chain2(Value value, Value pa, Dual a, Value pb, Dual b) {
+    Dual result = {
+        value,
+        Dual_term(pa, a.dx) + Dual_term(pb, b.dx),
+        Dual_term(pa, a.dy) + Dual_term(pb, b.dy)
+    };
+    return result;
+}
+
+Dual Dual_add(Dual a, Dual b) {
+    Dual result = { a.v + b.v, a.dx + b.dx, a.dy + b.dy };
+    return result;
+}
+
+Dual Dual_sub(Dual a, Dual b) {
+    Dual result = { a.v - b.v, a.dx - b.dx, a.dy - b.dy };
+    return result;
+}
+
+Dual Dual_mul(Dual a, Dual b) {
+    return Dual_chain2(a.v * b.v, b.v, a, a.v, b);
+}
+
+Dual Dual_div(Dual a, Dual b) {
+    const Value value = a.v / b.v;
+    return Dual_chain2(value, 1 / b.v, a, -value / b.v, b);
+}
+
+// max and min follow the operand the VM picks
+Dual Dual_max(Dual a, Dual b) {
+    return b.v > a.v ? b : a;
+}
+
+Dual Dual_min(Dual a, Dual b) {
+    return b.v < a.v ? b : a;
+}
+
+// function(a) where kernel identifies function, the value is taken from function itself so it
+// matches the VM exactly
+Dual Dual_unary(EVectorKernel kernel, Value (*function)(Value), Dual a) {
+    const Value x = a.v;
+    const Value value = function(x);
+    Value partial;
+    switch (kernel) {
+        case VK_SQRT:
+            partial = 0.5 / value;
+            break;
+        case VK_ABS:
+            partial = x > 0 ? 1 : x < 0 ? -1 : 0;
+            break;
+        case VK_FLOOR:
+        case VK_CEIL:
+        case VK_ROUND:
+            partial = 0;
+            break;
+        case VK_LOG:
+            partial = 1 / x;
+            break;
+        case VK_LOG10:
+            partial = 1 / (x * M_LN10);
+            break;
+        case VK_SIN:
+            partial = cos(x);
+            break;
+        case VK_COS:
+            partial = -sin(x);
+            break;
+        case VK_TAN:
+            partial = 1 + value * value;
+            break;
+        case VK_SINH:
+            partial = cosh(x);
+            break;
+        case VK_COSH:
+            partial = sinh(x);
+            break;
+        case VK_TANH:
+            partial = 1 - value * value;
+            break;
+        case VK_ASIN:
+            partial = 1 / sqrt(1 - x * x);
+            break;
+        case VK_ACOS:
+            partial = -1 / sqrt(1 - x * x);
+            break;
+        case VK_ATAN:
+            partial = 1 / (1 + x * x);
+            break;
+        default:
+            partial = NAN;
+    }
+    return Dual_chain(value, partial, a);
+}
+
+// function(a, b) where kernel identifies function
+Dual Dual_binary(EVectorKernel kernel, Value (*function)(Value, Value), Dual a, Dual b) {
+    const Value x = a.v;
+    const Value y = b.v;
+    const Value value = function(x, y);
+    Value pa, pb;
+    switch (kernel) {
+        case VK_POW:
+            pa = y * pow(x, y - 1);
+            pb = value * log(x);
+            break;
+        case VK_ATAN2:
+            // atan2(y, x) with the arguments named after their operands
+            pa = y / (x * x + y * y);
+            pb = -x / (x * x + y * y);
+            break;
+        case VK_LOGN:
+            pa = 1 / (x * log(y));
+            pb = -value / (y * log(y));
+            break;
+        case VK_MOD:
+            pa = 1;
+            pb = -trunc(x / y);
+            break;
+        default:
+            pa = NAN;
+            pb = NAN;
+    }
+    return Dual_chain2(value, pa, a, pb, b);
+}
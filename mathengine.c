@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <malloc.h>
+#include <alloca.h>
 #include <limits.h>
 #include <math.h>
 #include <string.h>
@@ -8,6 +9,11 @@
 
 typedef unsigned int uint;
 
+#include "mathvector.c"
+#include "mathinterval.c"
+#include "matharena.c"
+#include "mathdual.c"
+
 typedef Value (*CET_fn_unary_t)(Value);
 typedef Value (*CET_fn_binary_t)(Value, Value);
 typedef Value (*CET_fn_ternary_t)(Value, Value, Value);
@@ -36,7 +42,7 @@ typedef struct {
 } CompiledExpression_Value;
 
 typedef struct {
-    Value *valuep;
+    VariableIndex id;
 } CompiledExpression_Lookup;
 
 typedef union {
@@ -48,6 +54,7 @@ typedef struct {
     ECompiledExpression_Call type;
     uint argc;
     void *function;
+    EVectorKernel vector;
     char args[0];
 } CompiledExpression_Call;
 
@@ -71,25 +78,102 @@ typedef struct {
     VarSlot vars[MATH_MAX_VARS];
 } State;
 
+typedef enum {
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MAX, OP_MIN, OP_CALL_UNARY, OP_CALL_BINARY, OP_RETURN
+} EOpcode;
+
+// dst = a (op) b, calls use function and its vector kernel, return yields register a.
+// Instructions with a single operand repeat it in b
 typedef struct {
-    int used;
-    Value *value;
-} RegisterSlot;
+    EOpcode op;
+    uint dst;
+    uint a;
+    uint b;
+    void *function;
+    EVectorKernel vector;
+} Instruction;
+
+#ifdef MATH_PROFILE
+// Profiling builds count executions and clock ticks of every instruction run by the VM
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define Profile_clock() __rdtsc()
+#else
+#include <time.h>
+unsigned long long Profile_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
 
+// Instructions [begin, end) were emitted while lowering a compiled expression node,
+// nodes are numbered in the order they are lowered
 typedef struct {
-    RegisterSlot slots[MATH_MAX_VARS];
-} Register;
+    uint begin;
+    uint end;
+} ProgramNode;
 
+// Executions of an instruction and the ticks spent in it, batches count every lane
+typedef struct {
+    unsigned long long count;
+    unsigned long long cycles;
+} ProgramProfile;
+#endif
+
+// Native code of a program, evaluates it on a register file
+typedef Value (*ProgramFunction)(Value *registers);
+
+// Native batch evaluation, inputs is indexed by register instead of by variable
+typedef void (*ProgramBatchFunction)(const Value *registers, const Value *const *inputs, Value *out, uint count);
+
+// Registers hold the variables in [0, variable_count), followed by the constants
+// and then the temporaries. variables[i] is the variable held by register i.
+// deduplicated counts the subexpressions that reuse an earlier result, kernels are
+// the vector kernels picked for batches when the program was created.
+// native is set by Program_jit or Program_cc and used by Program_execute instead of the VM,
+// native_batch and library are only set by Program_cc.
+// Profiling builds keep the instructions of every node and the totals of freed contexts.
+// A program is immutable once created, its registers live in a ProgramContext
 typedef struct {
     uint size;
-    Register reg;
-    CompiledExpression *root;
+    const VectorKernels *kernels;
+    uint register_count;
+    uint variable_count;
+    uint constant_count;
+    uint code_length;
+    uint deduplicated;
+    Instruction *code;
+    Value *constants;
+    VariableIndex *variables;
+    ProgramFunction native;
+    uint native_size;
+    ProgramBatchFunction native_batch;
+    void *library;
+#ifdef MATH_PROFILE
+    uint node_count;
+    ProgramNode *nodes;
+    ProgramProfile *profile;
+#endif
     char data[0];
 } Program;
 
+// Registers of one evaluation of a program, batch holds the lanes of batch evaluation
+// and duals the registers of dual evaluation, both are allocated on first use.
+// Each thread evaluating a shared program needs its own
 typedef struct {
-    State *state;
-} CompilationContext;
+    Value *registers;
+    Value *batch;
+    Dual *duals;
+#ifdef MATH_PROFILE
+    const Program *program;
+    ProgramProfile *profile;
+#endif
+    char data[0];
+} ProgramContext;
+
+#include "mathjit.c"
+#include "mathcodegen.c"
 
 struct VariableOffset {
     VariableIndex id;
@@ -101,6 +185,24 @@ typedef struct {
     struct VariableOffset *offsets;
 } VariableOffsets;
 
+// Compiled trees are written depth first into one buffer. A node is reserved before its
+// arguments are compiled and its size filled in after, so every node is written once.
+// Nodes are addressed by position because the buffer moves as it grows
+typedef struct {
+    char *data;
+    uint length;
+    uint capacity;
+    VariableOffsets offsets;
+    uint offsets_capacity;
+} CompilationOutput;
+
+// Reduced expressions and compiled trees are allocated in arena, compile appends to output
+typedef struct {
+    State *state;
+    Arena *arena;
+    CompilationOutput *output;
+} CompilationContext;
+
 typedef struct {
     VariableOffsets offsets;  
     CompiledExpression *ce;
@@ -119,327 +221,806 @@ typedef struct {
 
 struct IExpression {
     Result (*evaluate)(void *this, State *state);
-    void (*destroy)(void *this);
+    // vars holds an interval for every variable index
+    Interval (*evaluateInterval)(void *this, const Interval *vars);
     void (*print)(void *this, FILE *fp);
 
     // compilation 
     int (*isConstant)(void *this, State *state);
-    Expression (*reduce)(void *this, State *state);
-    CompilationResult (*compile)(void *this, CompilationContext ctx);
+    Expression (*reduce)(void *this, CompilationContext ctx);
+    // appends the compiled tree to ctx.output, returns an error or NULL
+    char *(*compile)(void *this, CompilationContext ctx);
 };
 
 Result Expression_evaluate(Expression this, State *state) {
     return this.interface->evaluate(this.object, state);
 }
 
-void Expression_destroy(Expression this) {
-    return this.interface->destroy(this.object);
-}
-
-void Expression_free(Expression this) {
-    return free(this.object);
+Interval Expression_evaluateInterval(Expression this, const Interval *vars) {
+    return this.interface->evaluateInterval(this.object, vars);
 }
 
 void Expression_print(Expression this, FILE *fp) {
     return this.interface->print(this.object, fp);
 }
 
-Expression Expression_reduce(Expression this, State *state) {
-    return this.interface->reduce(this.object, state);
+Expression Expression_reduce(Expression this, CompilationContext ctx) {
+    return this.interface->reduce(this.object, ctx);
 }
 
 int Expression_isConstant(Expression this, State *state) {
     return this.interface->isConstant(this.object, state);
 }
 
-CompilationResult Expression_compile(Expression this, CompilationContext ctx) {
+char *Expression_compile(Expression this, CompilationContext ctx) {
     return this.interface->compile(this.object, ctx);
-};
-void VariableOffsets_add(VariableOffsets this, uint offset) {
-    for (uint i = 0; i < this.count; i++) {
-        this.offsets[i].offset += offset;
-    }
 }
 
-VariableOffsets VariableOffsets_join(VariableOffsets a, VariableOffsets b) {
-    VariableOffsets result;
-    result.count = a.count + b.count;
+CompiledExpression *CompilationOutput_at(CompilationOutput *this, uint position) {
+    return (void*)(this->data + position);
+}
 
-    if (result.count == 0) {
-        result.offsets = NULL;
-        return result;
+// Appends size bytes for a node and returns its position
+uint CompilationOutput_reserve(CompilationOutput *this, Arena *arena, uint size) {
+    if (this->length + size > this->capacity) {
+        uint capacity = this->capacity ? this->capacity * 2 : 256;
+        while (capacity < this->length + size) {
+            capacity *= 2;
+        }
+        char *data = Arena_alloc(arena, capacity);
+        if (this->length) {
+            memcpy(data, this->data, this->length);
+        }
+        this->data = data;
+        this->capacity = capacity;
     }
+    const uint position = this->length;
+    this->length += size;
+    return position;
+}
 
-    result.offsets = malloc(sizeof(struct VariableOffset) * result.count);
-
-    if (a.count != 0) {
-        memcpy(result.offsets, a.offsets, a.count * sizeof(struct VariableOffset));
-    }
-    if (b.count != 0) {
-        memcpy(result.offsets + a.count, b.offsets, b.count * sizeof(struct VariableOffset));
+// Records that the lookup of variable id is at position
+void CompilationOutput_variable(CompilationOutput *this, Arena *arena, VariableIndex id, uint position) {
+    if (this->offsets.count == this->offsets_capacity) {
+        this->offsets_capacity = this->offsets_capacity ? this->offsets_capacity * 2 : 16;
+        struct VariableOffset *offsets = Arena_alloc(arena, sizeof(struct VariableOffset) * this->offsets_capacity);
+        if (this->offsets.count) {
+            memcpy(offsets, this->offsets.offsets, sizeof(struct VariableOffset) * this->offsets.count);
+        }
+        this->offsets.offsets = offsets;
     }
+    this->offsets.offsets[this->offsets.count].id = id;
+    this->offsets.offsets[this->offsets.count].offset = position;
+    this->offsets.count++;
+}
 
-
-    return result;
+void compileConst(CompilationContext ctx, Value value) {
+    const uint size = sizeof(CompiledExpression) + sizeof(CompiledExpression_Value);
+    CompiledExpression *ce = CompilationOutput_at(ctx.output, CompilationOutput_reserve(ctx.output, ctx.arena, size));
+    ce->size = size;
+    ce->type = CET_VALUE;
+    ((CompiledExpression_Value*)ce->expression)->value = value;
 }
 
-CompilationResult createCompiledConst(Value value) {
+// Compiles an expression into a single tree, variable offsets are relative to its root
+CompilationResult compileTree(Expression expression, CompilationContext ctx) {
+    CompilationOutput output;
+    memset(&output, 0, sizeof(CompilationOutput));
+    ctx.output = &output;
+
     CompilationResult result;
-    result.error = NULL;
-    const uint size = sizeof(CompiledExpression) + sizeof(CompiledExpression_Value);
-    result.ce = malloc(size);
-    result.ce->size = size;
-    result.ce->type = CET_VALUE;
-    CompiledExpression_Value *vl = (void*)&result.ce->expression;
-    vl->value = value;
-    result.offsets.count = 0;
-    result.offsets.offsets = NULL;
+    result.error = Expression_compile(expression, ctx);
+    result.ce = result.error ? NULL : (void*)output.data;
+    result.offsets = output.offsets;
     return result;
 }
 
-Program *Program_create(CompilationResult cr) {
-    uint uses_per_var[MATH_MAX_VARS];
-    memset(uses_per_var, 0, MATH_MAX_VARS * sizeof(uint));
-    for (uint i = 0; i < cr.offsets.count; i++) {
-        uses_per_var[cr.offsets.offsets[i].id]++;
+#define CE_EXPRESSION(ce) ((void*)ce + sizeof(CompiledExpression))
+
+// Program construction, the compiled tree is lowered to instructions on virtual registers
+// which are then mapped to as few physical registers as their lifetimes allow
+
+typedef enum {
+    VR_VARIABLE, VR_CONSTANT, VR_TEMPORARY
+} EVirtualRegister;
+
+typedef struct {
+    EVirtualRegister kind;
+    Value value;
+    VariableIndex id;
+    uint last_use;
+    uint physical;
+} VirtualRegister;
+
+// Instructions are hash-consed as they are emitted: an instruction identical to an earlier one
+// (same opcode, function and operand registers) reuses its result, so repeated subtrees
+// are lowered to a DAG and evaluated once
+typedef struct {
+    Instruction *code;
+    uint length;
+    uint capacity;
+    VirtualRegister *vregs;
+    uint vreg_count;
+    uint vreg_capacity;
+    uint variables[MATH_MAX_VARS];
+    uint *table;
+    uint table_capacity;
+    // constant registers by value, hashed like the instructions
+    uint *constants;
+    uint constant_count;
+    uint constant_capacity;
+    uint deduplicated;
+#ifdef MATH_PROFILE
+    ProgramNode *nodes;
+    uint node_count;
+    uint node_capacity;
+#endif
+} ProgramBuilder;
+
+uint ProgramBuilder_vreg(ProgramBuilder *this, EVirtualRegister kind) {
+    if (this->vreg_count == this->vreg_capacity) {
+        this->vreg_capacity = this->vreg_capacity ? this->vreg_capacity * 2 : 16;
+        this->vregs = realloc(this->vregs, sizeof(VirtualRegister) * this->vreg_capacity);
     }
+    VirtualRegister *vr = &this->vregs[this->vreg_count];
+    memset(vr, 0, sizeof(VirtualRegister));
+    vr->kind = kind;
+    return this->vreg_count++;
+}
 
-    uint var_count = 0; 
+#define PROGRAM_BUILDER_EMPTY UINT_MAX
 
-    for (uint i = 0; i < MATH_MAX_VARS; i++) {
-        if (uses_per_var[i]) {
-            var_count++;
+uint ProgramBuilder_hash(EOpcode op, uint a, uint b, void *function) {
+    uint64_t h = (uint64_t)op * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ a) * 0xff51afd7ed558ccdULL;
+    h = (h ^ b) * 0xc4ceb9fe1a85ec53ULL;
+    h = (h ^ (uint64_t)(uintptr_t)function) * 0x9e3779b97f4a7c15ULL;
+    return (uint)(h >> 32);
+}
+
+// slot of the instruction matching the key, or the empty slot where it belongs
+uint *ProgramBuilder_find(ProgramBuilder *this, EOpcode op, uint a, uint b, void *function) {
+    uint mask = this->table_capacity - 1;
+    for (uint i = ProgramBuilder_hash(op, a, b, function) & mask; ; i = (i + 1) & mask) {
+        uint *slot = &this->table[i];
+        if (*slot == PROGRAM_BUILDER_EMPTY) {
+            return slot;
+        }
+        Instruction *in = &this->code[*slot];
+        if (in->op == op && in->a == a && in->b == b && in->function == function) {
+            return slot;
         }
     }
+}
 
-    const uint prog_size = sizeof(Program) + sizeof(Value) * var_count + cr.ce->size;
-
-    Program *prog = malloc(prog_size);
-    memset(prog, 0, prog_size);
-    prog->size = prog_size;
-    prog->root = (void*)prog + (prog_size - cr.ce->size);
-    
-    memcpy(prog->root, cr.ce, cr.ce->size);
+void ProgramBuilder_grow_table(ProgramBuilder *this) {
+    free(this->table);
+    this->table_capacity = this->table_capacity ? this->table_capacity * 2 : 64;
+    this->table = malloc(sizeof(uint) * this->table_capacity);
+    memset(this->table, 0xff, sizeof(uint) * this->table_capacity);
+    for (uint i = 0; i < this->length; i++) {
+        Instruction *in = &this->code[i];
+        *ProgramBuilder_find(this, in->op, in->a, in->b, in->function) = i;
+    }
+}
 
-    Value *var = (void*)prog->data;
-    
-    for (uint i = 0; i < MATH_MAX_VARS; i++) {
-        if (uses_per_var[i] >= 2) {
-            prog->reg.slots[i].used = 1;
-            prog->reg.slots[i].value = var;
-            var++;
+// slot of the constant register holding value, or the empty slot where it belongs
+uint *ProgramBuilder_find_constant(ProgramBuilder *this, Value value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(Value));
+    uint mask = this->constant_capacity - 1;
+    for (uint i = (uint)((bits * 0x9e3779b97f4a7c15ULL) >> 32) & mask; ; i = (i + 1) & mask) {
+        uint *slot = &this->constants[i];
+        if (*slot == PROGRAM_BUILDER_EMPTY || memcmp(&this->vregs[*slot].value, &value, sizeof(Value)) == 0) {
+            return slot;
         }
     }
+}
 
-    for (uint i = 0; i < cr.offsets.count; i++) {
-        struct VariableOffset offset = cr.offsets.offsets[i];
-        CompiledExpression *ex = (void*)prog->root + offset.offset;
-        if (uses_per_var[offset.id] > 1) {
-            ((CompiledExpression_VL*)ex->expression)->lookup.valuep = prog->reg.slots[offset.id].value;
-        } else {
-            ex->type = CET_VALUE;
-            prog->reg.slots[offset.id].used = 1;
-            prog->reg.slots[offset.id].value = &((CompiledExpression_VL*)ex->expression)->value.value;
+uint ProgramBuilder_constant(ProgramBuilder *this, Value value) {
+    if ((this->constant_count + 1) * 2 > this->constant_capacity) {
+        uint *constants = this->constants;
+        const uint capacity = this->constant_capacity;
+        this->constant_capacity = capacity ? capacity * 2 : 16;
+        this->constants = malloc(sizeof(uint) * this->constant_capacity);
+        memset(this->constants, 0xff, sizeof(uint) * this->constant_capacity);
+        for (uint i = 0; i < capacity; i++) {
+            if (constants[i] != PROGRAM_BUILDER_EMPTY) {
+                *ProgramBuilder_find_constant(this, this->vregs[constants[i]].value) = constants[i];
+            }
         }
+        free(constants);
     }
 
-    return prog;
+    uint *slot = ProgramBuilder_find_constant(this, value);
+    if (*slot == PROGRAM_BUILDER_EMPTY) {
+        *slot = ProgramBuilder_vreg(this, VR_CONSTANT);
+        this->vregs[*slot].value = value;
+        this->constant_count++;
+    }
+    return *slot;
 }
 
+uint ProgramBuilder_emit(ProgramBuilder *this, EOpcode op, uint a, uint b, void *function, EVectorKernel vector) {
+    // addition and multiplication commute exactly, order their operands so both forms match
+    if ((op == OP_ADD || op == OP_MUL) && b < a) {
+        uint t = a;
+        a = b;
+        b = t;
+    }
 
+    if ((this->length + 1) * 2 > this->table_capacity) {
+        ProgramBuilder_grow_table(this);
+    }
 
-Value CompiledExpression_evaluate(CompiledExpression*);
+    uint *slot = NULL;
+    if (op != OP_RETURN) {
+        slot = ProgramBuilder_find(this, op, a, b, function);
+        if (*slot != PROGRAM_BUILDER_EMPTY) {
+            this->deduplicated++;
+            return this->code[*slot].dst;
+        }
+    }
 
-Value CET_ADD_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 0;
-    for (uint i = 0; i < argc; i++) {
-        result += CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
+    if (this->length == this->capacity) {
+        this->capacity = this->capacity ? this->capacity * 2 : 16;
+        this->code = realloc(this->code, sizeof(Instruction) * this->capacity);
     }
-    return result;
+    Instruction *in = &this->code[this->length++];
+    in->op = op;
+    in->dst = op == OP_RETURN ? 0 : ProgramBuilder_vreg(this, VR_TEMPORARY);
+    in->a = a;
+    in->b = b;
+    in->function = function;
+    in->vector = vector;
+    if (slot) {
+        *slot = this->length - 1;
+    }
+    return in->dst;
 }
 
-Value CET_NEG_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 0;
-    for (uint i = 0; i < argc; i++) {
-        result -= CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
+uint ProgramBuilder_lower(ProgramBuilder *this, CompiledExpression *ce);
+
+// Variadic builtins become chains of binary instructions. Calls that start from the
+// identity element (neg, inv, and single argument add, sub, div, avg) keep it as a
+// constant operand so results match the interpreter exactly
+uint ProgramBuilder_lower_builtin(ProgramBuilder *this, CompiledExpression_Builtin *builtin) {
+    uint argc = builtin->argc;
+    CompiledExpression *argsp = (void*)builtin + sizeof(CompiledExpression_Builtin);
+
+    EOpcode op;
+    Value identity = 0;
+    int from_identity = 0;
+
+    switch (builtin->type) {
+        case CET_ADD:
+        case CET_AVG:
+            op = OP_ADD;
+            from_identity = argc == 1;
+            break;
+        case CET_NEG:
+            op = OP_SUB;
+            from_identity = 1;
+            break;
+        case CET_SUB:
+            op = OP_SUB;
+            from_identity = argc == 1;
+            break;
+        case CET_MUL:
+            op = OP_MUL;
+            identity = 1;
+            break;
+        case CET_INV:
+            op = OP_DIV;
+            identity = 1;
+            from_identity = 1;
+            break;
+        case CET_DIV:
+            op = OP_DIV;
+            identity = 1;
+            from_identity = argc == 1;
+            break;
+        case CET_MAX:
+            op = OP_MAX;
+            break;
+        case CET_MIN:
+            op = OP_MIN;
+            break;
+        default:
+            return ProgramBuilder_constant(this, 0);
     }
-    return result;
-}
 
-Value CET_SUB_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 0;
     if (argc == 0) {
-        return result;
-    } else if (argc == 1) {
-        result -= CompiledExpression_evaluate(argsp);
-        return result;
+        return ProgramBuilder_constant(this, identity);
     }
 
-    result = CompiledExpression_evaluate(argsp);
-
-    for (uint i = 1; i < argc; i++) {
-        result -= CompiledExpression_evaluate(argsp);
+    uint acc;
+    if (from_identity) {
+        acc = ProgramBuilder_constant(this, identity);
+    } else {
+        acc = ProgramBuilder_lower(this, argsp);
         argsp = (void*)argsp + argsp->size;
     }
-    return result;
-}
 
-Value CET_MUL_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 1;
-    for (uint i = 0; i < argc; i++) {
-        result *= CompiledExpression_evaluate(argsp);
+    for (uint i = from_identity ? 0 : 1; i < argc; i++) {
+        uint arg = ProgramBuilder_lower(this, argsp);
         argsp = (void*)argsp + argsp->size;
+        acc = ProgramBuilder_emit(this, op, acc, arg, NULL, VK_NONE);
     }
-    return result;
-}
 
-Value CET_INV_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 1;
-    for (uint i = 0; i < argc; i++) {
-        result /= CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
+    if (builtin->type == CET_AVG) {
+        acc = ProgramBuilder_emit(this, OP_DIV, acc, ProgramBuilder_constant(this, (Value)argc), NULL, VK_NONE);
     }
-    return result;
+
+    return acc;
 }
 
-Value CET_DIV_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 1;
-    if (argc == 0) {
-        return result;
-    } else if (argc == 1) {
-        result /= CompiledExpression_evaluate(argsp);
-        return result;
+uint ProgramBuilder_lower_call(ProgramBuilder *this, CompiledExpression_Call *call) {
+    CompiledExpression *argsp = (void*)call + sizeof(CompiledExpression_Call);
+    switch (call->type) {
+        case CET_CALL_UNARY:
+            uint arg = ProgramBuilder_lower(this, argsp);
+            return ProgramBuilder_emit(this, OP_CALL_UNARY, arg, arg, call->function, call->vector);
+        case CET_CALL_BINARY:
+            uint arg1 = ProgramBuilder_lower(this, argsp);
+            uint arg2 = ProgramBuilder_lower(this, (void*)argsp + argsp->size);
+            return ProgramBuilder_emit(this, OP_CALL_BINARY, arg1, arg2, call->function, call->vector);
+        default:
+            return ProgramBuilder_constant(this, 0);
     }
+}
 
-    result = CompiledExpression_evaluate(argsp);
-    argsp = (void*)argsp + argsp->size;
+uint ProgramBuilder_lower_node(ProgramBuilder *this, CompiledExpression *ce) {
+    switch (ce->type) {
+        case CET_VALUE:
+            return ProgramBuilder_constant(this, ((CompiledExpression_Value*)CE_EXPRESSION(ce))->value);
+        case CET_LOOKUP:
+            return this->variables[((CompiledExpression_Lookup*)CE_EXPRESSION(ce))->id];
+        case CET_BUILTIN:
+            return ProgramBuilder_lower_builtin(this, CE_EXPRESSION(ce));
+        case CET_CALL:
+            return ProgramBuilder_lower_call(this, CE_EXPRESSION(ce));
+        default:
+            return ProgramBuilder_constant(this, 0);
+    }
+}
 
-    for (uint i = 1; i < argc; i++) {
-        result /= CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
+uint ProgramBuilder_lower(ProgramBuilder *this, CompiledExpression *ce) {
+#ifdef MATH_PROFILE
+    if (this->node_count == this->node_capacity) {
+        this->node_capacity = this->node_capacity ? this->node_capacity * 2 : 16;
+        this->nodes = realloc(this->nodes, sizeof(ProgramNode) * this->node_capacity);
     }
+    const uint node = this->node_count++;
+    this->nodes[node].begin = this->length;
+    const uint result = ProgramBuilder_lower_node(this, ce);
+    this->nodes[node].end = this->length;
     return result;
+#else
+    return ProgramBuilder_lower_node(this, ce);
+#endif
 }
 
-Value CET_MAX_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 0;
+// Assigns physical registers: variables first, then constants, then temporaries,
+// a temporary's register is reused once its last reader has executed.
+// Returns the number of physical registers
+uint ProgramBuilder_allocate(ProgramBuilder *this, uint *variable_count, uint *constant_count) {
+    for (uint i = 0; i < this->length; i++) {
+        Instruction *in = &this->code[i];
+        this->vregs[in->a].last_use = i;
+        this->vregs[in->b].last_use = i;
+    }
 
-    if (argc == 0) {
-        return result;
+    uint count = 0;
+    *variable_count = 0;
+    *constant_count = 0;
+
+    for (uint i = 0; i < this->vreg_count; i++) {
+        if (this->vregs[i].kind == VR_VARIABLE) {
+            this->vregs[i].physical = count++;
+            (*variable_count)++;
+        }
+    }
+
+    for (uint i = 0; i < this->vreg_count; i++) {
+        if (this->vregs[i].kind == VR_CONSTANT) {
+            this->vregs[i].physical = count++;
+            (*constant_count)++;
+        }
     }
 
-    result = CompiledExpression_evaluate(argsp);
-    argsp = (void*)argsp + argsp->size;
+    uint *free_list = malloc(sizeof(uint) * (this->length + 1));
+    uint free_count = 0;
 
-    for (uint i = 1; i < argc; i++) {
-        Value a = CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
-        if (a > result) {
-            result = a;
+    for (uint i = 0; i < this->length; i++) {
+        Instruction *in = &this->code[i];
+        VirtualRegister *a = &this->vregs[in->a];
+        VirtualRegister *b = &this->vregs[in->b];
+
+        if (a->kind == VR_TEMPORARY && a->last_use == i) {
+            free_list[free_count++] = a->physical;
+        }
+        if (in->b != in->a && b->kind == VR_TEMPORARY && b->last_use == i) {
+            free_list[free_count++] = b->physical;
+        }
+
+        in->a = a->physical;
+        in->b = b->physical;
+
+        if (in->op != OP_RETURN) {
+            VirtualRegister *dst = &this->vregs[in->dst];
+            dst->physical = free_count ? free_list[--free_count] : count++;
+            in->dst = dst->physical;
         }
     }
-    return result;
+
+    free(free_list);
+    return count;
 }
 
-Value CET_MIN_eval(uint argc, CompiledExpression *argsp) {
-    Value result = 0;
+Program *Program_create(CompilationResult cr) {
+    ProgramBuilder builder;
+    memset(&builder, 0, sizeof(ProgramBuilder));
 
-    if (argc == 0) {
-        return result;
+    uint uses_per_var[MATH_MAX_VARS];
+    memset(uses_per_var, 0, MATH_MAX_VARS * sizeof(uint));
+    for (uint i = 0; i < cr.offsets.count; i++) {
+        uses_per_var[cr.offsets.offsets[i].id]++;
     }
 
-    result = CompiledExpression_evaluate(argsp);
-    argsp = (void*)argsp + argsp->size;
+    for (uint i = 0; i < MATH_MAX_VARS; i++) {
+        if (uses_per_var[i]) {
+            builder.variables[i] = ProgramBuilder_vreg(&builder, VR_VARIABLE);
+            builder.vregs[builder.variables[i]].id = i;
+        }
+    }
 
-    for (uint i = 1; i < argc; i++) {
-        Value a = CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
-        if (a < result) {
-            result = a;
+    uint result = ProgramBuilder_lower(&builder, cr.ce);
+    ProgramBuilder_emit(&builder, OP_RETURN, result, result, NULL, VK_NONE);
+
+    uint variable_count, constant_count;
+    uint register_count = ProgramBuilder_allocate(&builder, &variable_count, &constant_count);
+
+    const uint prog_size = sizeof(Program) + sizeof(Instruction) * builder.length
+        + sizeof(Value) * constant_count + sizeof(VariableIndex) * variable_count;
+
+    Program *prog = malloc(prog_size);
+    memset(prog, 0, prog_size);
+    prog->size = prog_size;
+    prog->kernels = Vector_kernels();
+    prog->register_count = register_count;
+    prog->variable_count = variable_count;
+    prog->constant_count = constant_count;
+    prog->code_length = builder.length;
+    prog->deduplicated = builder.deduplicated;
+    prog->code = (void*)prog->data;
+    prog->constants = (void*)(prog->code + builder.length);
+    prog->variables = (void*)(prog->constants + constant_count);
+
+    memcpy(prog->code, builder.code, sizeof(Instruction) * builder.length);
+
+    for (uint i = 0; i < builder.vreg_count; i++) {
+        VirtualRegister *vr = &builder.vregs[i];
+        if (vr->kind == VR_CONSTANT) {
+            prog->constants[vr->physical - variable_count] = vr->value;
+        } else if (vr->kind == VR_VARIABLE) {
+            prog->variables[vr->physical] = vr->id;
         }
     }
-    return result;
+
+    free(builder.code);
+    free(builder.vregs);
+    free(builder.table);
+    free(builder.constants);
+
+#ifdef MATH_PROFILE
+    prog->node_count = builder.node_count;
+    prog->nodes = builder.nodes;
+    prog->profile = calloc(builder.length, sizeof(ProgramProfile));
+#endif
+
+    return prog;
 }
 
-Value CET_AVG_eval(uint argc, CompiledExpression *argsp) {
-    Value sum = 0;
+void Program_free(Program *program) {
+    if (program->library) {
+        Program_free_library(program);
+    } else if (program->native) {
+        Program_free_native(program);
+    }
+#ifdef MATH_PROFILE
+    free(program->nodes);
+    free(program->profile);
+#endif
+    free(program);
+}
 
-    if (argc == 0) {
-        return sum;
+// Register holding variable id, -1 when the program doesn't read it
+int Program_register(const Program *program, VariableIndex id) {
+    for (uint i = 0; i < program->variable_count; i++) {
+        if (program->variables[i] == id) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    for (uint i = 0; i < argc; i++) {
-        sum += CompiledExpression_evaluate(argsp);
-        argsp = (void*)argsp + argsp->size;
+// Creates registers for program with the constants loaded and the variables set to 0
+ProgramContext *ProgramContext_create(const Program *program) {
+    ProgramContext *context = malloc(sizeof(ProgramContext) + sizeof(Value) * program->register_count);
+    context->registers = (void*)context->data;
+    context->batch = NULL;
+    context->duals = NULL;
+
+    memset(context->registers, 0, sizeof(Value) * program->register_count);
+    memcpy(context->registers + program->variable_count, program->constants, sizeof(Value) * program->constant_count);
+#ifdef MATH_PROFILE
+    context->program = program;
+    context->profile = calloc(program->code_length, sizeof(ProgramProfile));
+#endif
+    return context;
+}
+
+// Profiling builds add the counts of the context to the totals of its program
+void ProgramContext_free(ProgramContext *context) {
+#ifdef MATH_PROFILE
+    for (uint i = 0; i < context->program->code_length; i++) {
+        __atomic_fetch_add(&context->program->profile[i].count, context->profile[i].count, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&context->program->profile[i].cycles, context->profile[i].cycles, __ATOMIC_RELAXED);
     }
+    free(context->profile);
+#endif
+    free(context->batch);
+    free(context->duals);
+    free(context);
+}
 
-    return sum / (Value)argc;
+// Input register of variable id, NULL when the program doesn't read it
+Value *ProgramContext_variable(ProgramContext *context, const Program *program, VariableIndex id) {
+    int index = Program_register(program, id);
+    return index < 0 ? NULL : &context->registers[index];
 }
 
+// Dispatch uses computed goto where the compiler supports it and a switch otherwise.
+// Profiling builds charge the ticks since the previous instruction to the one just executed
 
-Value CompiledExpression_Builtin_evaluate(CompiledExpression_Builtin *this) {
-    uint argc = this->argc;
-    CompiledExpression *argsp = (void*)this + sizeof(CompiledExpression_Builtin);
-    switch (this->type) {
-        case CET_ADD:
-            return CET_ADD_eval(argc, argsp);
-        case CET_NEG:
-            return CET_NEG_eval(argc, argsp);
-        case CET_SUB:
-            return CET_SUB_eval(argc, argsp);
-        case CET_MUL:
-            return CET_MUL_eval(argc, argsp);
-        case CET_INV:
-            return CET_INV_eval(argc, argsp);
-        case CET_DIV:
-            return CET_DIV_eval(argc, argsp);
-        case CET_MAX:
-            return CET_MAX_eval(argc, argsp);
-        case CET_MIN:
-            return CET_MAX_eval(argc, argsp);
-        case CET_AVG:
-            return CET_MAX_eval(argc, argsp);
-        default:
-            return 0;
+#ifdef MATH_PROFILE
+#define VM_PROFILE_START() unsigned long long vm_clock = Profile_clock()
+#define VM_PROFILE_STEP() Profile_step(&context->profile[ip - program->code], &vm_clock, 1)
+
+void Profile_step(ProgramProfile *profile, unsigned long long *clock, uint count) {
+    const unsigned long long now = Profile_clock();
+    profile->count += count;
+    profile->cycles += now - *clock;
+    *clock = now;
+}
+#else
+#define VM_PROFILE_START()
+#define VM_PROFILE_STEP()
+#endif
+
+#if defined(__GNUC__)
+#define VM_START(dispatch) goto *dispatch[ip->op];
+#define VM_OP(name) L_##name:
+#define VM_NEXT(dispatch) VM_PROFILE_STEP(); goto *dispatch[(++ip)->op]
+#define VM_END()
+#else
+#define VM_START(dispatch) for (;; ip++) switch (ip->op) {
+#define VM_OP(name) case name:
+#define VM_NEXT(dispatch) VM_PROFILE_STEP(); break
+#define VM_END() }
+#endif
+
+Value Program_execute(const Program *program, ProgramContext *context) {
+#ifndef MATH_PROFILE
+    // native code isn't instrumented, profiling builds always run the VM
+    if (program->native) {
+        return program->native(context->registers);
     }
+#endif
+
+    Value *r = context->registers;
+    const Instruction *ip = program->code;
+    VM_PROFILE_START();
+
+#if defined(__GNUC__)
+    static const void *dispatch[] = {
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MAX, &&L_OP_MIN,
+        &&L_OP_CALL_UNARY, &&L_OP_CALL_BINARY, &&L_OP_RETURN
+    };
+#endif
+
+    VM_START(dispatch)
+    VM_OP(OP_ADD)
+        r[ip->dst] = r[ip->a] + r[ip->b];
+        VM_NEXT(dispatch);
+    VM_OP(OP_SUB)
+        r[ip->dst] = r[ip->a] - r[ip->b];
+        VM_NEXT(dispatch);
+    VM_OP(OP_MUL)
+        r[ip->dst] = r[ip->a] * r[ip->b];
+        VM_NEXT(dispatch);
+    VM_OP(OP_DIV)
+        r[ip->dst] = r[ip->a] / r[ip->b];
+        VM_NEXT(dispatch);
+    VM_OP(OP_MAX)
+        r[ip->dst] = r[ip->b] > r[ip->a] ? r[ip->b] : r[ip->a];
+        VM_NEXT(dispatch);
+    VM_OP(OP_MIN)
+        r[ip->dst] = r[ip->b] < r[ip->a] ? r[ip->b] : r[ip->a];
+        VM_NEXT(dispatch);
+    VM_OP(OP_CALL_UNARY)
+        r[ip->dst] = ((CET_fn_unary_t)ip->function)(r[ip->a]);
+        VM_NEXT(dispatch);
+    VM_OP(OP_CALL_BINARY)
+        r[ip->dst] = ((CET_fn_binary_t)ip->function)(r[ip->a], r[ip->b]);
+        VM_NEXT(dispatch);
+    VM_OP(OP_RETURN)
+        return r[ip->a];
+    VM_END()
 }
 
-Value CompiledExpression_Call_evaluate(CompiledExpression_Call *this) {
-    CompiledExpression *argsp = (void*)this + sizeof(CompiledExpression_Call);
-    switch (this->type) {
-        case CET_CALL_UNARY:
-            Value arg = CompiledExpression_evaluate(argsp);
-            Value (*ufn)(Value) = this->function;
-            return ufn(arg);
-        case CET_CALL_BINARY:
-            Value arg1 = CompiledExpression_evaluate(argsp);
-            Value arg2 = CompiledExpression_evaluate((void*)argsp + argsp->size);
-            Value(*bfn)(Value, Value) = this->function;
-            return bfn(arg1, arg2);
-        default:
-            return 0;
+// batch evaluation
+
+#define PROGRAM_BATCH_SIZE 256
+
+void Batch_fill(Value *out, uint count, Value value) {
+    for (uint i = 0; i < count; i++) {
+        out[i] = value;
     }
 }
 
-#define CE_EXPRESSION(ce) ((void*)ce + sizeof(CompiledExpression))
+// Evaluates the program for count points. inputs is indexed by variable,
+// variables with a NULL input keep the scalar value of their register in context
+void Program_execute_batch(const Program *program, ProgramContext *context, const Value *const *inputs, Value *out, uint count) {
+    const uint registers = program->register_count;
 
-Value CompiledExpression_evaluate(CompiledExpression *this) {
-    switch (this->type) {
-        case CET_VALUE:
-            return ((CompiledExpression_Value*)CE_EXPRESSION(this))->value;
-        case CET_LOOKUP:
-            return *((CompiledExpression_Lookup*)CE_EXPRESSION(this))->valuep;
-        case CET_BUILTIN:
-            return CompiledExpression_Builtin_evaluate((CompiledExpression_Builtin*)CE_EXPRESSION(this));
-        case CET_CALL:
-            return CompiledExpression_Call_evaluate((CompiledExpression_Call*)CE_EXPRESSION(this));
-        default:
-            return 0;
+#ifndef MATH_PROFILE
+    if (program->native_batch) {
+        const Value **slots = alloca(sizeof(Value*) * (program->variable_count + 1));
+        for (uint i = 0; i < program->variable_count; i++) {
+            slots[i] = inputs[program->variables[i]];
+        }
+        program->native_batch(context->registers, slots, out, count);
+        return;
+    }
+#endif
+
+    if (context->batch == NULL) {
+        context->batch = malloc(sizeof(Value) * PROGRAM_BATCH_SIZE * registers);
+        for (uint i = 0; i < program->constant_count; i++) {
+            Batch_fill(context->batch + (program->variable_count + i) * PROGRAM_BATCH_SIZE, PROGRAM_BATCH_SIZE, program->constants[i]);
+        }
+    }
+
+    Value **lanes = alloca(sizeof(Value*) * registers);
+    for (uint i = 0; i < registers; i++) {
+        lanes[i] = context->batch + i * PROGRAM_BATCH_SIZE;
+    }
+
+    for (uint i = 0; i < program->variable_count; i++) {
+        if (inputs[program->variables[i]] == NULL) {
+            Batch_fill(lanes[i], PROGRAM_BATCH_SIZE, context->registers[i]);
+        }
+    }
+
+    const VectorKernels *vk = program->kernels;
+
+    for (uint base = 0; base < count; base += PROGRAM_BATCH_SIZE) {
+        const uint n = count - base < PROGRAM_BATCH_SIZE ? count - base : PROGRAM_BATCH_SIZE;
+
+        for (uint i = 0; i < program->variable_count; i++) {
+            const Value *input = inputs[program->variables[i]];
+            if (input) {
+                lanes[i] = (Value*)input + base;
+            }
+        }
+
+        VM_PROFILE_START();
+        for (const Instruction *ip = program->code; ; ip++) {
+            Value *dst = lanes[ip->dst];
+            const Value *a = lanes[ip->a];
+            const Value *b = lanes[ip->b];
+            switch (ip->op) {
+                case OP_ADD:
+                    vk->add(dst, a, b, n);
+                    break;
+                case OP_SUB:
+                    vk->sub(dst, a, b, n);
+                    break;
+                case OP_MUL:
+                    vk->mul(dst, a, b, n);
+                    break;
+                case OP_DIV:
+                    vk->div(dst, a, b, n);
+                    break;
+                case OP_MAX:
+                    vk->max(dst, a, b, n);
+                    break;
+                case OP_MIN:
+                    vk->min(dst, a, b, n);
+                    break;
+                case OP_CALL_UNARY:
+                    VectorKernel_unary ukernel = vk->functions[ip->vector];
+                    if (ukernel) {
+                        ukernel(dst, a, n);
+                        break;
+                    }
+                    for (uint i = 0; i < n; i++) {
+                        dst[i] = ((CET_fn_unary_t)ip->function)(a[i]);
+                    }
+                    break;
+                case OP_CALL_BINARY:
+                    VectorKernel_binary bkernel = vk->functions[ip->vector];
+                    if (bkernel) {
+                        bkernel(dst, a, b, n);
+                        break;
+                    }
+                    for (uint i = 0; i < n; i++) {
+                        dst[i] = ((CET_fn_binary_t)ip->function)(a[i], b[i]);
+                    }
+                    break;
+                case OP_RETURN:
+                    memcpy(out + base, a, sizeof(Value) * n);
+                    goto next;
+            }
+#ifdef MATH_PROFILE
+            Profile_step(&context->profile[ip - program->code], &vm_clock, n);
+#endif
+        }
+
+        next:;
     }
 }
 
-Value Program_execute(Program *program) {
-    return CompiledExpression_evaluate(program->root);
-}
\ No newline at end of file
+// dual evaluation
+
+// Evaluates the program on dual numbers, returning the value with its derivatives along the
+// variables x and y. Variables keep the values of their registers in context. Always runs the
+// VM, native code only computes values
+Dual Program_execute_dual(const Program *program, ProgramContext *context, VariableIndex x, VariableIndex y) {
+    Dual *r = context->duals;
+    if (r == NULL) {
+        r = context->duals = malloc(sizeof(Dual) * program->register_count);
+        for (uint i = 0; i < program->constant_count; i++) {
+            r[program->variable_count + i] = Dual_constant(program->constants[i]);
+        }
+    }
+
+    for (uint i = 0; i < program->variable_count; i++) {
+        r[i] = Dual_constant(context->registers[i]);
+        r[i].dx = program->variables[i] == x;
+        r[i].dy = program->variables[i] == y;
+    }
+
+    for (const Instruction *ip = program->code; ; ip++) {
+        switch (ip->op) {
+            case OP_ADD:
+                r[ip->dst] = Dual_add(r[ip->a], r[ip->b]);
+                break;
+            case OP_SUB:
+                r[ip->dst] = Dual_sub(r[ip->a], r[ip->b]);
+                break;
+            case OP_MUL:
+                r[ip->dst] = Dual_mul(r[ip->a], r[ip->b]);
+                break;
+            case OP_DIV:
+                r[ip->dst] = Dual_div(r[ip->a], r[ip->b]);
+                break;
+            case OP_MAX:
+                r[ip->dst] = Dual_max(r[ip->a], r[ip->b]);
+                break;
+            case OP_MIN:
+                r[ip->dst] = Dual_min(r[ip->a], r[ip->b]);
+                break;
+            case OP_CALL_UNARY:
+                r[ip->dst] = Dual_unary(ip->vector, (CET_fn_unary_t)ip->function, r[ip->a]);
+                break;
+            case OP_CALL_BINARY:
+                r[ip->dst] = Dual_binary(ip->vector, (CET_fn_binary_t)ip->function, r[ip->a], r[ip->b]);
+                break;
+            case OP_RETURN:
+                return r[ip->a];
+        }
+    }
+}
@@ -5,10 +5,14 @@
 struct Builtin;
 
 typedef Result (*fn_builtin)(const struct Builtin *this, const Value *args, uint argc);
+typedef Interval (*fn_builtin_interval)(const struct Builtin *this, const Interval *args, uint argc);
 typedef struct Builtin {
     const char *token;
     fn_builtin function;
     void *payload;
+    // interval extension of function
+    fn_builtin_interval interval;
+    void *interval_payload;
 } Builtin;
 
 Result builtin_add(const Builtin *this, const Value *args, uint argc) {
@@ -157,6 +161,119 @@ Result builtin_avg(const Builtin *this, const Value *args, uint argc) {
     return result;
 }
 
+// Interval builtins, each encloses its scalar counterpart over the argument intervals
+
+Interval interval_add(const Builtin *this, const Interval *args, uint argc) {
+    Interval result = Interval_point(0);
+    for (uint i = 0; i < argc; i++) {
+        result = Interval_add(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_neg(const Builtin *this, const Interval *args, uint argc) {
+    return Interval_neg(interval_add(this, args, argc));
+}
+
+Interval interval_sub(const Builtin *this, const Interval *args, uint argc) {
+    if (argc < 2) {
+        return interval_neg(this, args, argc);
+    }
+
+    Interval result = args[0];
+    for (uint i = 1; i < argc; i++) {
+        result = Interval_sub(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_mul(const Builtin *this, const Interval *args, uint argc) {
+    Interval result = Interval_point(1);
+    for (uint i = 0; i < argc; i++) {
+        result = Interval_mul(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_inv(const Builtin *this, const Interval *args, uint argc) {
+    Interval result = Interval_point(1);
+    for (uint i = 0; i < argc; i++) {
+        result = Interval_div(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_div(const Builtin *this, const Interval *args, uint argc) {
+    if (argc < 2) {
+        return interval_inv(this, args, argc);
+    }
+
+    Interval result = args[0];
+    for (uint i = 1; i < argc; i++) {
+        result = Interval_div(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_unary(const Builtin *this, const Interval *args, uint argc) {
+    if (argc != 1) {
+        return Interval_entire();
+    }
+
+    Interval (*function)(Interval) = this->interval_payload;
+    return function(args[0]);
+}
+
+Interval interval_binary(const Builtin *this, const Interval *args, uint argc) {
+    if (argc != 2) {
+        return Interval_entire();
+    }
+
+    Interval (*function)(Interval, Interval) = this->interval_payload;
+    return function(args[0], args[1]);
+}
+
+// interval_payload is a scalar function increasing over its whole domain
+Interval interval_increasing(const Builtin *this, const Interval *args, uint argc) {
+    if (argc != 1) {
+        return Interval_entire();
+    }
+
+    return Interval_increasing(args[0], this->interval_payload);
+}
+
+Interval interval_max(const Builtin *this, const Interval *args, uint argc) {
+    if (argc == 0) {
+        return Interval_point(0);
+    }
+
+    Interval result = args[0];
+    for (uint i = 1; i < argc; i++) {
+        result = Interval_max(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_min(const Builtin *this, const Interval *args, uint argc) {
+    if (argc == 0) {
+        return Interval_point(0);
+    }
+
+    Interval result = args[0];
+    for (uint i = 1; i < argc; i++) {
+        result = Interval_min(result, args[i]);
+    }
+    return result;
+}
+
+Interval interval_avg(const Builtin *this, const Interval *args, uint argc) {
+    if (argc == 0) {
+        return Interval_point(0);
+    }
+
+    return Interval_div(interval_add(this, args, argc), Interval_point(argc));
+}
+
 Value round(Value x) {
     return floor(x + 0.5);
 }
@@ -165,6 +282,44 @@ Value logn(Value x, Value b) {
     return log(x) / log(b);
 }
 
+const struct {
+    void *function;
+    EVectorKernel kernel;
+} vector_functions[] = {
+    { &sqrt, VK_SQRT },
+    { &fabs, VK_ABS },
+    { &floor, VK_FLOOR },
+    { &ceil, VK_CEIL },
+    { &round, VK_ROUND },
+    { &log, VK_LOG },
+    { &log10, VK_LOG10 },
+    { &sin, VK_SIN },
+    { &cos, VK_COS },
+    { &tan, VK_TAN },
+    { &sinh, VK_SINH },
+    { &cosh, VK_COSH },
+    { &tanh, VK_TANH },
+    { &asin, VK_ASIN },
+    { &acos, VK_ACOS },
+    { &atan, VK_ATAN },
+    { &pow, VK_POW },
+    { &atan2, VK_ATAN2 },
+    { &logn, VK_LOGN },
+    // scalar only, identifies fmod for differentiation
+    { &fmod, VK_MOD },
+};
+
+// vector kernel implementing a builtin's libm function, VK_NONE if there is none.
+// Kernels without an implementation in a VectorKernels fall back to the function
+EVectorKernel Vector_find(void *function) {
+    for (uint i = 0; i < sizeof(vector_functions) / sizeof(vector_functions[0]); i++) {
+        if (vector_functions[i].function == function) {
+            return vector_functions[i].kernel;
+        }
+    }
+    return VK_NONE;
+}
+
 
 typedef struct {
     const Builtin *builtin;
@@ -172,6 +327,13 @@ typedef struct {
     uint argc; 
 } CallExpression;
 
+extern const struct IExpression ICallExpression;
+extern const struct IExpression IValueExpression;
+
+const Builtin *Builtin_find(const char *token);
+Expression ValueExpression_create(Arena *arena, Value value);
+Expression CallExpression_reduce(void *vthis, CompilationContext ctx);
+
 #define this ((CallExpression*)vthis)
 
 Result CallExpression_evaluate(void *vthis, State *state) {
@@ -186,12 +348,12 @@ Result CallExpression_evaluate(void *vthis, State *state) {
     return this->builtin->function(this->builtin, args, this->argc);
 }
 
-void CallExpression_destroy(void *vthis) {
+Interval CallExpression_evaluateInterval(void *vthis, const Interval *vars) {
+    Interval *args = alloca(this->argc * sizeof(Interval));
     for (uint i = 0; i < this->argc; i++) {
-        Expression_destroy(this->args[i]);
-        Expression_free(this->args[i]);
+        args[i] = Expression_evaluateInterval(this->args[i], vars);
     }
-    free(this->args);
+    return this->builtin->interval(this->builtin, args, this->argc);
 }
 
 void CallExpression_print(void *vthis, FILE *fp) {
@@ -212,25 +374,13 @@ int CallExpression_isConstant(void *vthis, State *state) {
     return 1;
 }
 
-CompilationResult CallExpression_compile(void *vthis, CompilationContext ctx) {
-    CompilationResult result;
-    result.error = NULL;
-    if (CallExpression_isConstant(this, ctx.state)) {
-        Result r = CallExpression_evaluate(this, ctx.state);
-        if (r.error) {
-            result.error = malloc(256);
-            sprintf(result.error, "Compilation error while evaluating constexpr: '%s'", r.error);
-            free(r.error);
-            return result;
-        }
-        return createCompiledConst(r.value);
-    }
-
+char *CallExpression_compile(void *vthis, CompilationContext ctx) {
     uint size = sizeof(CompiledExpression);
 
     ECompiledExpression_Type et;
     ECompiledExpression_Builtin eb;
     ECompiledExpression_Call ec;
+    uint arity = 0;
 
     void *fn = this->builtin->function;
 
@@ -263,24 +413,16 @@ CompilationResult CallExpression_compile(void *vthis, CompilationContext ctx) {
         goto handleBuiltin;
     } else if (fn == &builtin_unary) {
         ec = CET_CALL_UNARY;
-        if (this->argc != 1) {
-            result.error = malloc(256);
-            sprintf(result.error, "Compilation error: unary call requires one arg, have %u", this->args);
-            return result;
-        }
+        arity = 1;
         goto handleCall;
     } else if (fn == &builtin_binary) {
         ec = CET_CALL_BINARY;
-        if (this->argc != 2) {
-            result.error = malloc(256);
-            sprintf(result.error, "Compilation error: binary call requires two args, have %u", this->args);
-            return result;
-        }
+        arity = 2;
         goto handleCall;
     } else {
-        result.error = malloc(256);
-        sprintf(result.error, "Compilation error: unrecognized builtin");
-        return result;
+        char *error = malloc(256);
+        sprintf(error, "Compilation error: unrecognized builtin");
+        return error;
     }
 
     handleBuiltin:;
@@ -294,77 +436,84 @@ CompilationResult CallExpression_compile(void *vthis, CompilationContext ctx) {
     size += sizeof(CompiledExpression_Call);
 
     next:;
-    
-    CompilationResult *results = alloca(sizeof(CompilationResult) * this->argc);
-    for (uint i = 0; i < this->argc; i++) {
-        CompilationResult r = Expression_compile(this->args[i], ctx);
-        // TODO: free on error
-        if (r.error) {
-            result.error = r.error;
-            return result;
-        }
-        results[i] = r;
-        size += r.ce->size;
-    }
 
-    CompiledExpression *ex = malloc(size);
-    ex->size = size;
+    CompilationOutput *out = ctx.output;
+    const uint start = CompilationOutput_reserve(out, ctx.arena, size);
+    CompiledExpression *ex = CompilationOutput_at(out, start);
     ex->type = et;
-
-    void *argsp;
-    uint offset = sizeof(CompiledExpression);
     switch (et) {
         case CET_BUILTIN:
-            offset += sizeof(CompiledExpression_Builtin);
             CompiledExpression_Builtin *pb = (void*)ex->expression;
             pb->type = eb;
             pb->argc = this->argc;
-            argsp = (void*)pb->args;
             break;
         case CET_CALL:
-            offset += sizeof(CompiledExpression_Call);
             CompiledExpression_Call *pc = (void*)ex->expression;
             pc->type = ec;
             pc->argc = this->argc;
             pc->function = this->builtin->payload;
-            argsp = (void*)pc->args;
+            pc->vector = Vector_find(pc->function);
             break;
         default:
     }
 
-    VariableOffsets voff = { 0, NULL };
+    // arguments follow the node, it is constant when all of them compiled to values
+    int constant = 1;
+    for (uint i = 0; i < this->argc; i++) {
+        const uint position = out->length;
+        char *error = Expression_compile(this->args[i], ctx);
+        if (error) {
+            return error;
+        }
+        constant &= CompilationOutput_at(out, position)->type == CET_VALUE;
+    }
+
+    if (constant) {
+        out->length = start;
+        Result r = CallExpression_evaluate(this, ctx.state);
+        if (r.error) {
+            char *error = malloc(256);
+            sprintf(error, "Compilation error while evaluating constexpr: '%s'", r.error);
+            free(r.error);
+            return error;
+        }
+        compileConst(ctx, r.value);
+        return NULL;
+    }
 
-    argsp = (void*)ex + offset;
+    if (arity && this->argc != arity) {
+        char *error = malloc(256);
+        sprintf(error, "Compilation error: %s call requires %s, have %u",
+            arity == 1 ? "unary" : "binary", arity == 1 ? "one arg" : "two args", this->argc);
+        return error;
+    }
 
-    for (uint i = 0; i < this->argc; i++) {
-        CompilationResult r = results[i];
-        memcpy(argsp, (void*)r.ce, r.ce->size);
-        VariableOffsets_add(r.offsets, offset);
-        VariableOffsets vo = VariableOffsets_join(voff, r.offsets);
-        offset += r.ce->size;
-        argsp = (void*)ex + offset;
-        free(voff.offsets);
-        voff = vo;
-        free(r.offsets.offsets);
-        free(r.ce);
-    }
-
-    result.offsets = voff;
-    result.ce = ex;
-    return result;
+    CompilationOutput_at(out, start)->size = out->length - start;
+    return NULL;
 }
 
 #undef this
 
 const struct IExpression ICallExpression = {
     &CallExpression_evaluate,
-    &CallExpression_destroy,
+    &CallExpression_evaluateInterval,
     &CallExpression_print,
     &CallExpression_isConstant,
-    NULL,
+    &CallExpression_reduce,
     &CallExpression_compile
 };
 
+// args must live at least as long as arena
+Expression CallExpression_create(Arena *arena, const Builtin *builtin, Expression *args, uint argc) {
+    CallExpression *ce = Arena_alloc(arena, sizeof(CallExpression));
+    ce->builtin = builtin;
+    ce->args = args;
+    ce->argc = argc;
+
+    Expression result = { &ICallExpression, ce };
+    return result;
+}
+
 typedef struct {
     Value value;
 } ValueExpression;
@@ -376,7 +525,9 @@ Result ValueExpression_evaluate(void *vthis, State *state) {
     return result;
 }
 
-void ValueExpression_destroy(void *vthis) {}
+Interval ValueExpression_evaluateInterval(void *vthis, const Interval *vars) {
+    return Interval_point(this->value);
+}
 
 void ValueExpression_print(void *vthis, FILE *fp) {
     fprintf(fp, "%lf", this->value);
@@ -386,21 +537,34 @@ int ValueExpression_isConstant(void *vthis, State *state) {
     return 1;
 }
 
-CompilationResult ValueExpression_compile(void *vthis, CompilationContext ctx) {
-    return createCompiledConst(this->value);
+Expression ValueExpression_reduce(void *vthis, CompilationContext ctx) {
+    return ValueExpression_create(ctx.arena, this->value);
+}
+
+char *ValueExpression_compile(void *vthis, CompilationContext ctx) {
+    compileConst(ctx, this->value);
+    return NULL;
 }
 
 #undef this
 
 const struct IExpression IValueExpression = {
     &ValueExpression_evaluate,
-    &ValueExpression_destroy,
+    &ValueExpression_evaluateInterval,
     &ValueExpression_print,
     &ValueExpression_isConstant,
-    NULL,
+    &ValueExpression_reduce,
     &ValueExpression_compile
 };
 
+Expression ValueExpression_create(Arena *arena, Value value) {
+    ValueExpression *ve = Arena_alloc(arena, sizeof(ValueExpression));
+    ve->value = value;
+
+    Expression result = { &IValueExpression, ve };
+    return result;
+}
+
 typedef struct {
     VarIndex index;
 } VariableExpression;
@@ -418,7 +582,9 @@ Result VariableExpression_evaluate(void *vthis, State *state) {
     return result;
 }
 
-void VariableExpression_destroy(void *vthis) {}
+Interval VariableExpression_evaluateInterval(void *vthis, const Interval *vars) {
+    return vars[this->index];
+}
 
 void VariableExpression_print(void *vthis, FILE *fp) {
     fprintf(fp, "%c", this->index);
@@ -431,93 +597,408 @@ int VariableExpression_isConstant(void *vthis, State *state) {
     return 0;
 }
 
-CompilationResult VariableExpression_compile(void *vthis, CompilationContext ctx) {
-    CompilationResult result;
-    result.error = NULL;
+Expression VariableExpression_create(Arena *arena, VarIndex index);
+
+Expression VariableExpression_reduce(void *vthis, CompilationContext ctx) {
+    if (VariableExpression_isConstant(vthis, ctx.state)) {
+        Result r = VariableExpression_evaluate(vthis, ctx.state);
+        if (!r.error) {
+            return ValueExpression_create(ctx.arena, r.value);
+        }
+        free(r.error);
+    }
+    return VariableExpression_create(ctx.arena, this->index);
+}
+
+char *VariableExpression_compile(void *vthis, CompilationContext ctx) {
     if (VariableExpression_isConstant(vthis, ctx.state)) {
         Result r = VariableExpression_evaluate(this, ctx.state);
         if (r.error) {
-            result.error = malloc(256);
-            sprintf(result.error, "Compilation error while evaluating constexpr: '%s'", r.error);
-            return result;
+            char *error = malloc(256);
+            sprintf(error, "Compilation error while evaluating constexpr: '%s'", r.error);
+            return error;
         }
-        return createCompiledConst(r.value);
+        compileConst(ctx, r.value);
+        return NULL;
     }
 
-
     const uint size = sizeof(CompiledExpression) + sizeof(CompiledExpression_VL);
-    result.ce = malloc(size);
-    result.ce->size = size;
-    result.ce->type = CET_LOOKUP;
-    result.offsets.count = 1;
-    struct VariableOffset *offset = malloc(sizeof(struct VariableOffset));
-    offset->id = this->index;
-    offset->offset = 0;
-    result.offsets.offsets = offset;
-    return result;
+    const uint position = CompilationOutput_reserve(ctx.output, ctx.arena, size);
+    CompiledExpression *ce = CompilationOutput_at(ctx.output, position);
+    ce->size = size;
+    ce->type = CET_LOOKUP;
+    ((CompiledExpression_VL*)ce->expression)->lookup.id = this->index;
+    CompilationOutput_variable(ctx.output, ctx.arena, this->index, position);
+    return NULL;
 }
 
 #undef this
 
 const struct IExpression IVariableExpression = {
     &VariableExpression_evaluate,
-    &VariableExpression_destroy,
+    &VariableExpression_evaluateInterval,
     &VariableExpression_print,
     &VariableExpression_isConstant,
-    NULL,
+    &VariableExpression_reduce,
     &VariableExpression_compile
 };
 
+Expression VariableExpression_create(Arena *arena, VarIndex index) {
+    VariableExpression *ve = Arena_alloc(arena, sizeof(VariableExpression));
+    ve->index = index;
+
+    Expression result = { &IVariableExpression, ve };
+    return result;
+}
+
 
 #define ARRLEN(arr) (sizeof(arr) / sizeof(arr[0]))
 
 const Builtin builtins[] = {
     // basic
-    { "add", builtin_add, NULL },
-    { "neg", builtin_neg, NULL },
-    { "sub", builtin_sub, NULL },
-    { "mul", builtin_mul, NULL },
-    { "inv", builtin_inv, NULL },
-    { "div", builtin_div, NULL },
-    { "pow", builtin_binary, &pow },
-    { "mod", builtin_binary, &fmod },
-    { "sqrt", builtin_unary, &sqrt },
+    { "add", builtin_add, NULL, interval_add, NULL },
+    { "neg", builtin_neg, NULL, interval_neg, NULL },
+    { "sub", builtin_sub, NULL, interval_sub, NULL },
+    { "mul", builtin_mul, NULL, interval_mul, NULL },
+    { "inv", builtin_inv, NULL, interval_inv, NULL },
+    { "div", builtin_div, NULL, interval_div, NULL },
+    { "pow", builtin_binary, &pow, interval_binary, &Interval_pow },
+    { "mod", builtin_binary, &fmod, interval_binary, &Interval_mod },
+    { "sqrt", builtin_unary, &sqrt, interval_unary, &Interval_sqrt },
     
-    { "loge", builtin_unary, &log },
-    { "log10", builtin_unary, &log10 },
-    { "log", builtin_binary, &logn },
+    { "loge", builtin_unary, &log, interval_unary, &Interval_log },
+    { "log10", builtin_unary, &log10, interval_unary, &Interval_log10 },
+    { "log", builtin_binary, &logn, interval_binary, &Interval_logn },
 
-    { "ceil", builtin_unary, &ceil },
-    { "floor", builtin_unary, &floor },
-    { "round", builtin_unary, &round },
-    { "abs", builtin_unary, &fabs },
+    { "ceil", builtin_unary, &ceil, interval_unary, &Interval_ceil },
+    { "floor", builtin_unary, &floor, interval_unary, &Interval_floor },
+    { "round", builtin_unary, &round, interval_unary, &Interval_round },
+    { "abs", builtin_unary, &fabs, interval_unary, &Interval_abs },
 
-    { "max", builtin_max, NULL },
-    { "min", builtin_min, NULL },
-    { "avg", builtin_avg, NULL },
+    { "max", builtin_max, NULL, interval_max, NULL },
+    { "min", builtin_min, NULL, interval_min, NULL },
+    { "avg", builtin_avg, NULL, interval_avg, NULL },
 
     // trig
-    { "sin", builtin_unary, &sin },
-    { "cos", builtin_unary, &cos },
-    { "tan", builtin_unary, &tan },
-    { "sinh", builtin_unary, &sinh },
-    { "cosh", builtin_unary, &cosh },
-    { "tanh", builtin_unary, &tanh },
-    { "asin", builtin_unary, &asin },
-    { "acos", builtin_unary, &acos },
-    { "atan", builtin_unary, &atan },
-    { "atan2", builtin_binary, &atan2 },
+    { "sin", builtin_unary, &sin, interval_unary, &Interval_sin },
+    { "cos", builtin_unary, &cos, interval_unary, &Interval_cos },
+    { "tan", builtin_unary, &tan, interval_unary, &Interval_tan },
+    { "sinh", builtin_unary, &sinh, interval_increasing, &sinh },
+    { "cosh", builtin_unary, &cosh, interval_unary, &Interval_cosh },
+    { "tanh", builtin_unary, &tanh, interval_increasing, &tanh },
+    { "asin", builtin_unary, &asin, interval_unary, &Interval_asin },
+    { "acos", builtin_unary, &acos, interval_unary, &Interval_acos },
+    { "atan", builtin_unary, &atan, interval_increasing, &atan },
+    { "atan2", builtin_binary, &atan2, interval_binary, &Interval_atan2 },
 };
 
+const Builtin *Builtin_find(const char *token) {
+    for (uint i = 0; i < ARRLEN(builtins); i++) {
+        if (strcmp(builtins[i].token, token) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// Simplification
+
+// Expressions built by the simplifier are allocated in the arena of the compilation context.
+// reduce always returns a new tree, Expression_copy duplicates a subtree without simplifying it.
+
+#define CALL_REDUCE_MAX_POW 16
+// integer powers are only expanded into products while the result has at most this many nodes,
+// larger ones stay calls so nested powers don't grow exponentially
+#define CALL_REDUCE_MAX_POW_NODES 256
+
+int Expression_isValue(Expression e, Value *value) {
+    if (e.interface != &IValueExpression) {
+        return 0;
+    }
+    if (value) {
+        *value = ((ValueExpression*)e.object)->value;
+    }
+    return 1;
+}
+
+int Expression_isCall(Expression e, const Builtin *builtin) {
+    return e.interface == &ICallExpression && ((CallExpression*)e.object)->builtin == builtin;
+}
+
+Expression CallExpression_create2(Arena *arena, const Builtin *builtin, Expression a, Expression b) {
+    Expression *args = Arena_alloc(arena, sizeof(Expression) * 2);
+    args[0] = a;
+    args[1] = b;
+    return CallExpression_create(arena, builtin, args, 2);
+}
+
+uint Expression_size(Expression e) {
+    if (e.interface != &ICallExpression) {
+        return 1;
+    }
+    const CallExpression *call = e.object;
+    uint size = 1;
+    for (uint i = 0; i < call->argc; i++) {
+        size += Expression_size(call->args[i]);
+    }
+    return size;
+}
+
+// Copies the tree of e as it is, unlike reduce which would splice nested products
+Expression Expression_copy(Expression e, Arena *arena) {
+    if (e.interface == &IValueExpression) {
+        return ValueExpression_create(arena, ((ValueExpression*)e.object)->value);
+    }
+    if (e.interface == &IVariableExpression) {
+        return VariableExpression_create(arena, ((VariableExpression*)e.object)->index);
+    }
+    const CallExpression *call = e.object;
+    Expression *args = Arena_alloc(arena, sizeof(Expression) * (call->argc ? call->argc : 1));
+    for (uint i = 0; i < call->argc; i++) {
+        args[i] = Expression_copy(call->args[i], arena);
+    }
+    return CallExpression_create(arena, call->builtin, args, call->argc);
+}
+
+// base^n for n >= 1 by repeated squaring. The operands of a square are identical copies,
+// which the program builder merges into one
+Expression CallExpression_power(Expression base, uint n, CompilationContext ctx) {
+    if (n == 1) {
+        return base;
+    }
+    const Builtin *mul = Builtin_find("mul");
+    Expression half = CallExpression_power(base, n / 2, ctx);
+    Expression square = CallExpression_create2(ctx.arena, mul, half, Expression_copy(half, ctx.arena));
+    if (n % 2) {
+        return CallExpression_create2(ctx.arena, mul, square, Expression_copy(base, ctx.arena));
+    }
+    return square;
+}
+
+#define this ((CallExpression*)vthis)
+
+Expression CallExpression_reduce(void *vthis, CompilationContext ctx) {
+    const Builtin *builtin = this->builtin;
+    const int is_add = builtin->function == &builtin_add;
+    const int is_mul = builtin->function == &builtin_mul;
+
+    // reduce arguments, splicing nested add/mul calls into this one. One extra slot is left
+    // for the folded constant
+    Expression *reduced = alloca(sizeof(Expression) * (this->argc ? this->argc : 1));
+    uint capacity = 1;
+    for (uint i = 0; i < this->argc; i++) {
+        reduced[i] = Expression_reduce(this->args[i], ctx);
+        const int splice = (is_add || is_mul) && Expression_isCall(reduced[i], builtin);
+        capacity += splice ? ((CallExpression*)reduced[i].object)->argc : 1;
+    }
+
+    uint argc = 0;
+    Expression *args = Arena_alloc(ctx.arena, sizeof(Expression) * capacity);
+    for (uint i = 0; i < this->argc; i++) {
+        if ((is_add || is_mul) && Expression_isCall(reduced[i], builtin)) {
+            CallExpression *inner = reduced[i].object;
+            memcpy(args + argc, inner->args, sizeof(Expression) * inner->argc);
+            argc += inner->argc;
+            continue;
+        }
+        args[argc++] = reduced[i];
+    }
+
+    // fold calls whose arguments are all constant
+    Value *values = alloca(sizeof(Value) * (argc ? argc : 1));
+    uint constants = 0;
+    for (uint i = 0; i < argc; i++) {
+        if (Expression_isValue(args[i], &values[i])) {
+            constants++;
+        }
+    }
+
+    if (constants == argc) {
+        Result r = builtin->function(builtin, values, argc);
+        if (!r.error) {
+            return ValueExpression_create(ctx.arena, r.value);
+        }
+        free(r.error);
+        return CallExpression_create(ctx.arena, builtin, args, argc);
+    }
+
+    // fold the constants of add/mul and of the subtrahends or divisors of sub/div into one,
+    // dropping it when it is the identity
+    const int is_sub = builtin->function == &builtin_sub && argc >= 2;
+    const int is_div = builtin->function == &builtin_div && argc >= 2;
+
+    if (is_add || is_mul || is_sub || is_div) {
+        const uint first = is_sub || is_div ? 1 : 0;
+        Value folded = is_mul || is_div ? 1 : 0;
+        uint kept = first;
+        for (uint i = first; i < argc; i++) {
+            Value v;
+            if (Expression_isValue(args[i], &v)) {
+                folded = is_mul || is_div ? folded * v : folded + v;
+                continue;
+            }
+            args[kept++] = args[i];
+        }
+
+        Value reciprocal = 1 / folded;
+        const int reciprocal_finite = isfinite(reciprocal) && reciprocal != 0;
+        const int identity = is_mul || is_div ? folded == 1 : folded == 0;
+
+        if (is_div && !identity && !reciprocal_finite) {
+            args[kept++] = ValueExpression_create(ctx.arena, folded);
+        } else if (!identity && !is_div) {
+            memmove(args + first + 1, args + first, sizeof(Expression) * (kept - first));
+            args[first] = ValueExpression_create(ctx.arena, folded);
+            kept++;
+        }
+        argc = kept;
+
+        Expression result;
+        if (argc == 1) {
+            // a lone add/mul argument, or a sub/div whose subtrahends or divisors were all
+            // folded away, (sub a) would negate
+            result = args[0];
+        } else if (argc == 0) {
+            return ValueExpression_create(ctx.arena, folded);
+        } else {
+            result = CallExpression_create(ctx.arena, builtin, args, argc);
+        }
+
+        // division by a constant becomes multiplication by its reciprocal
+        if (is_div && !identity && reciprocal_finite) {
+            result = CallExpression_create2(ctx.arena, Builtin_find("mul"), result, ValueExpression_create(ctx.arena, reciprocal));
+        }
+        return result;
+    }
+
+    // small integer powers become multiplication chains
+    Value exponent;
+    if (builtin->function == &builtin_binary && builtin->payload == &pow && argc == 2
+            && Expression_isValue(args[1], &exponent)
+            && exponent == floor(exponent) && fabs(exponent) <= CALL_REDUCE_MAX_POW
+            && fabs(exponent) * Expression_size(args[0]) <= CALL_REDUCE_MAX_POW_NODES) {
+        if (exponent == 0) {
+            return ValueExpression_create(ctx.arena, 1);
+        }
+
+        Expression power = CallExpression_power(args[0], (uint)fabs(exponent), ctx);
+        if (exponent < 0) {
+            Expression *inv = Arena_alloc(ctx.arena, sizeof(Expression));
+            inv[0] = power;
+            return CallExpression_create(ctx.arena, Builtin_find("inv"), inv, 1);
+        }
+        return power;
+    }
+
+    return CallExpression_create(ctx.arena, builtin, args, argc);
+}
+
+#undef this
+
+// Simplifies the expression and compiles the result
+CompilationResult compileExpression(Expression expression, CompilationContext ctx) {
+    return compileTree(Expression_reduce(expression, ctx), ctx);
+}
+
+// Like Expression_print but constants are printed exactly
+void Expression_print_exact(Expression expression, FILE *fp) {
+    if (expression.interface == &IValueExpression) {
+        fprintf(fp, "%a", ((ValueExpression*)expression.object)->value);
+    } else if (expression.interface == &ICallExpression) {
+        CallExpression *call = expression.object;
+        fprintf(fp, "(%s", call->builtin->token);
+        for (uint i = 0; i < call->argc; i++) {
+            fprintf(fp, " ");
+            Expression_print_exact(call->args[i], fp);
+        }
+        fprintf(fp, ")");
+    } else {
+        Expression_print(expression, fp);
+    }
+}
+
+// Text of the simplified expression, equal texts compile to the same program
+char *canonicalExpression(Expression expression, State *state) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *fp = open_memstream(&text, &length);
+    Arena arena;
+    Arena_init(&arena);
+    CompilationContext ctx = { state, &arena };
+    Expression_print_exact(Expression_reduce(expression, ctx), fp);
+    Arena_free(&arena);
+    fclose(fp);
+    return text;
+}
+
+#ifdef MATH_PROFILE
+
+// Prints the call at node of the compiled tree and its subcalls, one per line indented by depth.
+// expression is the reduced expression the tree was compiled from. Returns the node after the subtree
+uint Program_print_profile_node(const Program *program, Expression expression, CompiledExpression *ce, uint node, uint depth, unsigned long long total, FILE *fp) {
+    // leaves and calls folded to constants cost nothing
+    if (ce->type != CET_CALL && ce->type != CET_BUILTIN) {
+        return node + 1;
+    }
+
+    const ProgramNode range = program->nodes[node];
+    if (range.begin == range.end) {
+        fprintf(fp, "%7s %14s %12s  %*s", "reused", "", "", depth * 2, "");
+    } else {
+        unsigned long long cycles = 0;
+        for (uint i = range.begin; i < range.end; i++) {
+            cycles += program->profile[i].cycles;
+        }
+        fprintf(fp, "%6.2f%% %14llu %12llu  %*s", total ? 100.0 * cycles / total : 0, cycles,
+            program->profile[range.end - 1].count, depth * 2, "");
+    }
+    Expression_print(expression, fp);
+    fprintf(fp, "\n");
+
+    CallExpression *call = expression.object;
+    CompiledExpression *arg = (void*)CE_EXPRESSION(ce)
+        + (ce->type == CET_CALL ? sizeof(CompiledExpression_Call) : sizeof(CompiledExpression_Builtin));
+    node++;
+    for (uint i = 0; i < call->argc; i++) {
+        node = Program_print_profile_node(program, call->args[i], arg, node, depth + 1, total, fp);
+        arg = (void*)arg + arg->size;
+    }
+    return node;
+}
+
+// Prints the share of the VM's time spent in every subexpression of expression, which program
+// was compiled from. Subexpressions evaluated once for several uses are charged to the first
+void Program_print_profile(const Program *program, Expression expression, State *state, FILE *fp) {
+    unsigned long long total = 0;
+    for (uint i = 0; i < program->code_length; i++) {
+        total += program->profile[i].cycles;
+    }
+
+    Arena arena;
+    Arena_init(&arena);
+    CompilationContext ctx = { state, &arena };
+    Expression reduced = Expression_reduce(expression, ctx);
+    CompilationResult cr = compileTree(reduced, ctx);
+    if (cr.error) {
+        free(cr.error);
+    } else {
+        fprintf(fp, "Profile of %llu ticks\n%7s %14s %12s  %s\n", total, "share", "ticks", "evaluations", "expression");
+        Program_print_profile_node(program, reduced, cr.ce, 0, 0, total, fp);
+    }
+    Arena_free(&arena);
+}
+
+#endif
+
 typedef struct {
     Expression expression;
     char *error;
 } ParserResult;
 
 
-ParserResult parseExpression(char**);
+ParserResult parseExpression(char **input, Arena *arena);
 
-ParserResult parseCall(char **input) {
+ParserResult parseCall(char **input, Arena *arena) {
     ParserResult result;
     result.error = NULL;
 
@@ -554,21 +1035,13 @@ ParserResult parseCall(char **input) {
 
     next:;
 
-    const Builtin *builtin;
-
     *bp = '\0'; 
-    for (uint i = 0; i < ARRLEN(builtins); i++) {
-        if (strcmp(builtins[i].token, fname) == 0) {
-            builtin = &builtins[i];
-            goto loadargs; 
-        }
+    const Builtin *builtin = Builtin_find(fname);
+    if (builtin == NULL) {
+        result.error = malloc(64);
+        sprintf(result.error, "Function '%s' not defined", fname);
+        return result;
     }
-    
-    result.error = malloc(64);
-    sprintf(result.error, "Function '%s' not defined", fname);
-    return result;
-
-    loadargs:;
 
     Expression args[32];
     uint argc = 0;
@@ -590,7 +1063,7 @@ ParserResult parseCall(char **input) {
                 return result;
             }
 
-            ParserResult r = parseExpression(input);
+            ParserResult r = parseExpression(input, arena);
             if (r.error) {
                 return r;
             }
@@ -606,19 +1079,14 @@ ParserResult parseCall(char **input) {
 
     finish:;
 
-    CallExpression *ce = malloc(sizeof(CallExpression));
-    ce->builtin = builtin; 
-    ce->args = malloc(sizeof(Expression) * argc);
-    memcpy(ce->args, args, sizeof(Expression) * argc);
-    ce->argc = argc;
-
-    result.expression.interface = &ICallExpression;
-    result.expression.object = ce;
+    Expression *cargs = Arena_alloc(arena, sizeof(Expression) * argc);
+    memcpy(cargs, args, sizeof(Expression) * argc);
+    result.expression = CallExpression_create(arena, builtin, cargs, argc);
 
     return result;
 }
 
-ParserResult parseNumber(char **input) {
+ParserResult parseNumber(char **input, Arena *arena) {
     ParserResult result;
     result.error = NULL;
 
@@ -655,16 +1123,12 @@ ParserResult parseNumber(char **input) {
         return result;
     }
     
-    ValueExpression *ve = malloc(sizeof(ValueExpression));
-    ve->value = value;
-
-    result.expression.interface = &IValueExpression;
-    result.expression.object = ve;
+    result.expression = ValueExpression_create(arena, value);
 
     return result;
 }
 
-ParserResult parseVar(char **input) {
+ParserResult parseVar(char **input, Arena *arena) {
     ParserResult result;
     result.error = NULL;
 
@@ -678,24 +1142,21 @@ ParserResult parseVar(char **input) {
         return result;
     }
 
-    VariableExpression *ve = malloc(sizeof(VariableExpression));
-    ve->index = index;
-
-    result.expression.interface = &IVariableExpression;
-    result.expression.object = ve;
+    result.expression = VariableExpression_create(arena, index);
 
     return result;
 }
 
-ParserResult parseExpression(char **input) {
+// Parses the expression at *input into arena, which owns it from then on
+ParserResult parseExpression(char **input, Arena *arena) {
     char c = **input;
     if (c == '(') {
         (*input)++;
-        return parseCall(input);        
+        return parseCall(input, arena);        
     } else if (c >= '0' && c <= '9' || c == '-') {
-        return parseNumber(input);
+        return parseNumber(input, arena);
     } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
-        return parseVar(input);
+        return parseVar(input, arena);
     }
 
     ParserResult result;
@@ -718,6 +1179,13 @@ void State_init(State *state) {
     state->vars['E'].value = M_E;
 }
 
+// Fills vars with the point intervals of the variables in state, undefined ones span everything
+void State_intervals(const State *state, Interval *vars) {
+    for (uint i = 0; i < MATH_MAX_VARS; i++) {
+        vars[i] = state->vars[i].occupied ? Interval_point(state->vars[i].value) : Interval_entire();
+    }
+}
+
 int main(int argc, const char **argv) {
     if (argc < 2) {
         fprintf(stderr, "Provide expression\n");
@@ -727,10 +1195,13 @@ int main(int argc, const char **argv) {
     char in[256];
     strcpy(in, argv[1]);
     char *cursor = in;
-    ParserResult result = parseExpression(&cursor);
+    Arena arena;
+    Arena_init(&arena);
+    ParserResult result = parseExpression(&cursor, &arena);
     if (result.error) {
         fprintf(stderr, "Parser error: %s\n", result.error);
         free(result.error);
+        Arena_free(&arena);
         return 1;
     }
 
@@ -751,15 +1222,30 @@ int main(int argc, const char **argv) {
         fprintf(stderr, "Evaluated: %lf\n", res.value);
     }
 
-    CompilationContext ctx = { &state };
-    Program *prog = Program_create(Expression_compile(result.expression, ctx));
-    if (prog->reg.slots['x'].used) {
-        Value *xp = prog->reg.slots['x'].value;
+    CompilationContext ctx = { &state, &arena };
+    Expression reduced = Expression_reduce(result.expression, ctx);
+    fprintf(stderr, "Reduced: ");
+    Expression_print(reduced, stderr);
+    fprintf(stderr, "\n");
+
+    Interval vars[MATH_MAX_VARS];
+    State_intervals(&state, vars);
+    vars['x'].lo -= 1;
+    vars['x'].hi += 1;
+    Interval range = Expression_evaluateInterval(result.expression, vars);
+    fprintf(stderr, "Interval over x in [%lf, %lf]: [%lf, %lf]\n", vars['x'].lo, vars['x'].hi, range.lo, range.hi);
+
+    Program *prog = Program_create(compileExpression(result.expression, ctx));
+    ProgramContext *context = ProgramContext_create(prog);
+    Value *xp = ProgramContext_variable(context, prog, 'x');
+    if (xp) {
         *xp = 5.12;
     }
-    Value r = Program_execute(prog);
+    Value r = Program_execute(prog, context);
     fprintf(stderr, "Compiled result: %lf\n", r);
 
-    Expression_destroy(result.expression);
-    Expression_free(result.expression);
+    ProgramContext_free(context);
+    Program_free(prog);
+
+    Arena_free(&arena);
 }
\ No newline at end of file
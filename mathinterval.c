@@ -0,0 +1,286 @@
+// Interval arithmetic, every operation returns an interval enclosing all results
+// for arguments within its operands. Bounds are widened outwards by a few ulps so
+// rounding in libm and the vector kernels stays inside, and any operation that
+// could produce NaN yields the entire real line
+
+#include <float.h>
+
+typedef struct {
+    Value lo;
+    Value hi;
+} Interval;
+
+#define INTERVAL_SLACK (DBL_EPSILON * 8)
+
+Interval Interval_point(Value value) {
+    Interval result = { value, value };
+    return result;
+}
+
+Interval Interval_entire() {
+    Interval result = { -INFINITY, INFINITY };
+    return result;
+}
+
+// Rounds the bounds outwards, a NaN bound makes the result entire
+Interval Interval_make(Value lo, Value hi) {
+    if (isnan(lo) || isnan(hi)) {
+        return Interval_entire();
+    }
+    Interval result = {
+        lo - Value_fabs(lo) * INTERVAL_SLACK - DBL_MIN,
+        hi + Value_fabs(hi) * INTERVAL_SLACK + DBL_MIN
+    };
+    return result;
+}
+
+int Interval_contains(Interval this, Value value) {
+    return this.lo <= value && value <= this.hi;
+}
+
+Interval Interval_add(Interval a, Interval b) {
+    return Interval_make(a.lo + b.lo, a.hi + b.hi);
+}
+
+Interval Interval_sub(Interval a, Interval b) {
+    return Interval_make(a.lo - b.hi, a.hi - b.lo);
+}
+
+Interval Interval_neg(Interval a) {
+    Interval result = { -a.hi, -a.lo };
+    return result;
+}
+
+Interval Interval_mul(Interval a, Interval b) {
+    const Value p[4] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+    Value lo = p[0];
+    Value hi = p[0];
+    for (uint i = 1; i < 4; i++) {
+        if (isnan(p[i])) {
+            return Interval_entire();
+        }
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+    return Interval_make(lo, hi);
+}
+
+Interval Interval_inv(Interval a) {
+    if (Interval_contains(a, 0)) {
+        return Interval_entire();
+    }
+    return Interval_make(1 / a.hi, 1 / a.lo);
+}
+
+Interval Interval_div(Interval a, Interval b) {
+    if (Interval_contains(b, 0)) {
+        return Interval_entire();
+    }
+    return Interval_mul(a, Interval_inv(b));
+}
+
+Interval Interval_max(Interval a, Interval b) {
+    Interval result = { a.lo > b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi };
+    return result;
+}
+
+Interval Interval_min(Interval a, Interval b) {
+    Interval result = { a.lo < b.lo ? a.lo : b.lo, a.hi < b.hi ? a.hi : b.hi };
+    return result;
+}
+
+// fn must be non-decreasing on the whole interval
+Interval Interval_increasing(Interval a, Value (*fn)(Value)) {
+    return Interval_make(fn(a.lo), fn(a.hi));
+}
+
+Interval Interval_sqrt(Interval a) {
+    if (a.lo < 0) {
+        return Interval_entire();
+    }
+    return Interval_increasing(a, sqrt);
+}
+
+Interval Interval_log(Interval a) {
+    if (a.lo < 0) {
+        return Interval_entire();
+    }
+    return Interval_increasing(a, log);
+}
+
+Interval Interval_log10(Interval a) {
+    if (a.lo < 0) {
+        return Interval_entire();
+    }
+    return Interval_increasing(a, log10);
+}
+
+Interval Interval_logn(Interval a, Interval b) {
+    return Interval_div(Interval_log(a), Interval_log(b));
+}
+
+Interval Interval_floor(Interval a) {
+    Interval result = { floor(a.lo), floor(a.hi) };
+    return result;
+}
+
+Interval Interval_ceil(Interval a) {
+    Interval result = { ceil(a.lo), ceil(a.hi) };
+    return result;
+}
+
+Interval Interval_round(Interval a) {
+    Interval result = { floor(a.lo + 0.5), floor(a.hi + 0.5) };
+    return result;
+}
+
+Interval Interval_abs(Interval a) {
+    if (a.lo >= 0) {
+        return a;
+    }
+    if (a.hi <= 0) {
+        return Interval_neg(a);
+    }
+    Interval result = { 0, -a.lo > a.hi ? -a.lo : a.hi };
+    return result;
+}
+
+// Integer power, exact bounds for even exponents over intervals containing 0
+Interval Interval_powi(Interval a, int n) {
+    if (n < 0) {
+        return Interval_inv(Interval_powi(a, -n));
+    }
+    if (n == 0) {
+        return Interval_point(1);
+    }
+    if (n % 2 == 1 || a.lo >= 0) {
+        return Interval_make(pow(a.lo, n), pow(a.hi, n));
+    }
+    if (a.hi <= 0) {
+        return Interval_make(pow(a.hi, n), pow(a.lo, n));
+    }
+    Value lo = pow(a.lo, n);
+    Value hi = pow(a.hi, n);
+    return Interval_make(0, lo > hi ? lo : hi);
+}
+
+Interval Interval_pow(Interval a, Interval b) {
+    if (b.lo == b.hi && Value_fabs(b.lo) <= 1024 && b.lo == (int)b.lo) {
+        return Interval_powi(a, (int)b.lo);
+    }
+    if (a.lo < 0) {
+        return Interval_entire();
+    }
+
+    // pow is monotonic in each argument for non-negative bases, the corners bound it
+    const Value p[4] = { pow(a.lo, b.lo), pow(a.lo, b.hi), pow(a.hi, b.lo), pow(a.hi, b.hi) };
+    Value lo = p[0];
+    Value hi = p[0];
+    for (uint i = 1; i < 4; i++) {
+        if (isnan(p[i])) {
+            return Interval_entire();
+        }
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+    return Interval_make(lo, hi);
+}
+
+// fmod keeps the sign of a and is smaller than b in magnitude
+Interval Interval_mod(Interval a, Interval b) {
+    if (Interval_contains(b, 0) || isinf(a.lo) || isinf(a.hi)) {
+        return Interval_entire();
+    }
+
+    const Value m = Value_fabs(b.lo) > Value_fabs(b.hi) ? Value_fabs(b.lo) : Value_fabs(b.hi);
+    if (b.lo == b.hi && (a.lo >= 0 || a.hi <= 0) && trunc(a.lo / m) == trunc(a.hi / m)) {
+        return Interval_make(fmod(a.lo, m), fmod(a.hi, m));
+    }
+
+    Interval result = {
+        a.lo < 0 ? (a.lo > -m ? a.lo : -m) : 0,
+        a.hi > 0 ? (a.hi < m ? a.hi : m) : 0
+    };
+    return result;
+}
+
+// Bounds a 2pi periodic fn with its maximum at max_at and minimum at max_at + pi
+Interval Interval_periodic(Interval a, Value (*fn)(Value), Value max_at) {
+    if (isinf(a.lo) || isinf(a.hi)) {
+        return Interval_entire();
+    }
+    if (a.hi - a.lo >= 2 * M_PI) {
+        Interval result = { -1, 1 };
+        return result;
+    }
+
+    Value lo = fn(a.lo);
+    Value hi = fn(a.hi);
+    if (lo > hi) {
+        Value t = lo;
+        lo = hi;
+        hi = t;
+    }
+
+    if (floor((a.hi - max_at) / (2 * M_PI)) != floor((a.lo - max_at) / (2 * M_PI))) {
+        hi = 1;
+    }
+    if (floor((a.hi - max_at - M_PI) / (2 * M_PI)) != floor((a.lo - max_at - M_PI) / (2 * M_PI))) {
+        lo = -1;
+    }
+
+    return Interval_make(lo, hi);
+}
+
+Interval Interval_sin(Interval a) {
+    return Interval_periodic(a, sin, M_PI / 2);
+}
+
+Interval Interval_cos(Interval a) {
+    return Interval_periodic(a, cos, 0);
+}
+
+// tan is increasing between its poles at pi/2 + k pi
+Interval Interval_tan(Interval a) {
+    if (isinf(a.lo) || isinf(a.hi) || a.hi - a.lo >= M_PI) {
+        return Interval_entire();
+    }
+    if (floor((a.hi - M_PI / 2) / M_PI) != floor((a.lo - M_PI / 2) / M_PI)) {
+        return Interval_entire();
+    }
+    return Interval_increasing(a, tan);
+}
+
+Interval Interval_cosh(Interval a) {
+    return Interval_increasing(Interval_abs(a), cosh);
+}
+
+Interval Interval_asin(Interval a) {
+    if (a.lo < -1 || a.hi > 1) {
+        return Interval_entire();
+    }
+    return Interval_increasing(a, asin);
+}
+
+Interval Interval_acos(Interval a) {
+    if (a.lo < -1 || a.hi > 1) {
+        return Interval_entire();
+    }
+    return Interval_make(acos(a.hi), acos(a.lo));
+}
+
+// atan2 is monotonic in each argument away from the branch cut along the negative x axis
+Interval Interval_atan2(Interval y, Interval x) {
+    if (x.lo <= 0 && Interval_contains(y, 0)) {
+        return Interval_make(-M_PI, M_PI);
+    }
+
+    const Value p[4] = { atan2(y.lo, x.lo), atan2(y.lo, x.hi), atan2(y.hi, x.lo), atan2(y.hi, x.hi) };
+    Value lo = p[0];
+    Value hi = p[0];
+    for (uint i = 1; i < 4; i++) {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+    return Interval_make(lo, hi);
+}
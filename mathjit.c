@@ -0,0 +1,248 @@
+// Native code for programs on x86-64. Every instruction becomes scalar SSE2 code, the first
+// JIT_HOMES registers of the program live in xmm2 to xmm15 for the whole evaluation and the
+// rest are memory operands in the register file, which rbx points at. Calls clobber every
+// xmm register so the homed registers still needed after a call are spilled around it
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+#include <stdint.h>
+
+#define JIT_HOMES 14
+
+typedef struct {
+    unsigned char *code;
+    uint length;
+    uint capacity;
+} JitBuffer;
+
+void Jit_byte(JitBuffer *this, unsigned char byte) {
+    if (this->length == this->capacity) {
+        this->capacity = this->capacity ? this->capacity * 2 : 256;
+        this->code = realloc(this->code, this->capacity);
+    }
+    this->code[this->length++] = byte;
+}
+
+void Jit_u32(JitBuffer *this, uint32_t value) {
+    for (uint i = 0; i < 4; i++) {
+        Jit_byte(this, value >> (i * 8));
+    }
+}
+
+void Jit_u64(JitBuffer *this, uint64_t value) {
+    for (uint i = 0; i < 8; i++) {
+        Jit_byte(this, value >> (i * 8));
+    }
+}
+
+int Jit_homed(uint r) {
+    return r < JIT_HOMES;
+}
+
+uint Jit_home(uint r) {
+    return r + 2;
+}
+
+// prefix [rex] 0f opcode modrm, rex is only emitted when an xmm register above 7 is used
+void Jit_sse_start(JitBuffer *this, unsigned char prefix, unsigned char opcode, uint reg, uint rm) {
+    Jit_byte(this, prefix);
+    if (reg >= 8 || rm >= 8) {
+        Jit_byte(this, 0x40 | (reg >= 8) << 2 | (rm >= 8));
+    }
+    Jit_byte(this, 0x0f);
+    Jit_byte(this, opcode);
+}
+
+// op xmm reg, xmm rm
+void Jit_sse_reg(JitBuffer *this, unsigned char prefix, unsigned char opcode, uint reg, uint rm) {
+    Jit_sse_start(this, prefix, opcode, reg, rm);
+    Jit_byte(this, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op xmm reg, [rbx + disp32]
+void Jit_sse_mem(JitBuffer *this, unsigned char prefix, unsigned char opcode, uint reg, uint32_t disp) {
+    Jit_sse_start(this, prefix, opcode, reg, 0);
+    Jit_byte(this, 0x80 | (reg & 7) << 3 | 3);
+    Jit_u32(this, disp);
+}
+
+#define JIT_SD 0xf2
+#define JIT_PD 0x66
+#define JIT_MOVSD_LOAD 0x10
+#define JIT_MOVSD_STORE 0x11
+#define JIT_MOVAPD 0x28
+
+// op xmm reg, program register r
+void Jit_sse_operand(JitBuffer *this, unsigned char opcode, uint reg, uint r) {
+    if (Jit_homed(r)) {
+        Jit_sse_reg(this, JIT_SD, opcode, reg, Jit_home(r));
+    } else {
+        Jit_sse_mem(this, JIT_SD, opcode, reg, r * sizeof(Value));
+    }
+}
+
+void Jit_load(JitBuffer *this, uint xmm, uint r) {
+    if (!Jit_homed(r)) {
+        Jit_sse_mem(this, JIT_SD, JIT_MOVSD_LOAD, xmm, r * sizeof(Value));
+    } else if (Jit_home(r) != xmm) {
+        Jit_sse_reg(this, JIT_PD, JIT_MOVAPD, xmm, Jit_home(r));
+    }
+}
+
+void Jit_store(JitBuffer *this, uint r, uint xmm) {
+    if (!Jit_homed(r)) {
+        Jit_sse_mem(this, JIT_SD, JIT_MOVSD_STORE, xmm, r * sizeof(Value));
+    } else if (Jit_home(r) != xmm) {
+        Jit_sse_reg(this, JIT_PD, JIT_MOVAPD, Jit_home(r), xmm);
+    }
+}
+
+// dst = x op y, max and min pass b as x so maxsd picks b only when it is greater like the VM
+void Jit_arithmetic(JitBuffer *this, unsigned char opcode, uint dst, uint x, uint y) {
+    if (Jit_homed(dst) && dst != y) {
+        Jit_load(this, Jit_home(dst), x);
+        Jit_sse_operand(this, opcode, Jit_home(dst), y);
+        return;
+    }
+    Jit_load(this, 0, x);
+    Jit_sse_operand(this, opcode, 0, y);
+    Jit_store(this, dst, 0);
+}
+
+// Calls function with a in xmm0 and b in xmm1, preserving the homed registers in keep.
+// Variables and constants below fixed are never written so their memory is always current
+void Jit_call(JitBuffer *this, const Instruction *in, uint32_t keep, uint fixed) {
+    for (uint r = fixed; r < JIT_HOMES; r++) {
+        if (keep & 1u << r) {
+            Jit_sse_mem(this, JIT_SD, JIT_MOVSD_STORE, Jit_home(r), r * sizeof(Value));
+        }
+    }
+
+    Jit_load(this, 0, in->a);
+    if (in->op == OP_CALL_BINARY) {
+        Jit_load(this, 1, in->b);
+    }
+
+    // mov rax, function; call rax
+    Jit_byte(this, 0x48);
+    Jit_byte(this, 0xb8);
+    Jit_u64(this, (uint64_t)(uintptr_t)in->function);
+    Jit_byte(this, 0xff);
+    Jit_byte(this, 0xd0);
+
+    Jit_store(this, in->dst, 0);
+
+    for (uint r = 0; r < JIT_HOMES; r++) {
+        if (keep & 1u << r) {
+            Jit_sse_mem(this, JIT_SD, JIT_MOVSD_LOAD, Jit_home(r), r * sizeof(Value));
+        }
+    }
+}
+
+// Compiles program to native code, Program_execute runs it from then on.
+// Returns an error if the code can't be made executable
+char *Program_jit(Program *program) {
+    const uint length = program->code_length;
+
+    // homed registers read after each instruction
+    uint32_t *live = malloc(sizeof(uint32_t) * length);
+    uint32_t mask = 0;
+    for (uint i = length; i-- > 0;) {
+        const Instruction *in = &program->code[i];
+        live[i] = mask;
+        if (in->op != OP_RETURN && Jit_homed(in->dst)) {
+            mask &= ~(1u << in->dst);
+        }
+        mask |= (Jit_homed(in->a) ? 1u << in->a : 0) | (Jit_homed(in->b) ? 1u << in->b : 0);
+    }
+
+    JitBuffer buffer = { NULL, 0, 0 };
+
+    // push rbx; mov rbx, rdi
+    Jit_byte(&buffer, 0x53);
+    Jit_byte(&buffer, 0x48);
+    Jit_byte(&buffer, 0x89);
+    Jit_byte(&buffer, 0xfb);
+
+    // what is live before the first instruction are variables and constants
+    for (uint r = 0; r < JIT_HOMES; r++) {
+        if (mask & 1u << r) {
+            Jit_sse_mem(&buffer, JIT_SD, JIT_MOVSD_LOAD, Jit_home(r), r * sizeof(Value));
+        }
+    }
+
+    const uint fixed = program->variable_count + program->constant_count;
+    for (uint i = 0; i < length; i++) {
+        const Instruction *in = &program->code[i];
+        switch (in->op) {
+            case OP_ADD:
+                Jit_arithmetic(&buffer, 0x58, in->dst, in->a, in->b);
+                break;
+            case OP_MUL:
+                Jit_arithmetic(&buffer, 0x59, in->dst, in->a, in->b);
+                break;
+            case OP_SUB:
+                Jit_arithmetic(&buffer, 0x5c, in->dst, in->a, in->b);
+                break;
+            case OP_MIN:
+                Jit_arithmetic(&buffer, 0x5d, in->dst, in->b, in->a);
+                break;
+            case OP_DIV:
+                Jit_arithmetic(&buffer, 0x5e, in->dst, in->a, in->b);
+                break;
+            case OP_MAX:
+                Jit_arithmetic(&buffer, 0x5f, in->dst, in->b, in->a);
+                break;
+            case OP_CALL_UNARY:
+            case OP_CALL_BINARY:
+                Jit_call(&buffer, in, Jit_homed(in->dst) ? live[i] & ~(1u << in->dst) : live[i], fixed);
+                break;
+            case OP_RETURN:
+                // the result goes in xmm0; pop rbx; ret
+                Jit_load(&buffer, 0, in->a);
+                Jit_byte(&buffer, 0x5b);
+                Jit_byte(&buffer, 0xc3);
+                break;
+        }
+    }
+    free(live);
+
+    void *code = mmap(NULL, buffer.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(buffer.code);
+        char *error = malloc(64);
+        sprintf(error, "Failed to map %u bytes of native code", buffer.length);
+        return error;
+    }
+    memcpy(code, buffer.code, buffer.length);
+    free(buffer.code);
+
+    if (mprotect(code, buffer.length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, buffer.length);
+        char *error = malloc(64);
+        sprintf(error, "Failed to make native code executable");
+        return error;
+    }
+
+    program->native = (ProgramFunction)code;
+    program->native_size = buffer.length;
+    return NULL;
+}
+
+void Program_free_native(Program *program) {
+    munmap((void*)program->native, program->native_size);
+}
+
+#else
+
+char *Program_jit(Program *program) {
+    char *error = malloc(64);
+    sprintf(error, "Native code is only generated on x86-64");
+    return error;
+}
+
+void Program_free_native(Program *program) {
+}
+
+#endif
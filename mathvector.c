@@ -0,0 +1,114 @@
+// Vectorized array kernels used by the batch evaluator, the instruction set
+// is picked once at runtime from what the CPU supports
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void (*VectorKernel_unary)(Value *out, const Value *a, uint n);
+typedef void (*VectorKernel_binary)(Value *out, const Value *a, const Value *b, uint n);
+
+typedef enum {
+    VK_NONE, VK_SQRT, VK_ABS, VK_FLOOR, VK_CEIL, VK_ROUND, VK_LOG, VK_LOG10,
+    VK_SIN, VK_COS, VK_TAN, VK_SINH, VK_COSH, VK_TANH, VK_ASIN, VK_ACOS, VK_ATAN,
+    VK_POW, VK_ATAN2, VK_LOGN, VK_MOD, VK_COUNT
+} EVectorKernel;
+
+typedef struct {
+    const char *name;
+    // out = a (op) b
+    VectorKernel_binary add, sub, mul, div, max, min;
+    // out = fn(a) for unary kernels, out = fn(a, b) for binary ones, NULL when only scalar is available
+    void *functions[VK_COUNT];
+} VectorKernels;
+
+Value Vector_scalar_round(Value x) {
+    return floor(x + 0.5);
+}
+
+Value Vector_scalar_logn(Value x, Value b) {
+    return log(x) / log(b);
+}
+
+#define VECTOR_SCALAR_KERNEL(name, op) \
+void Vector_scalar_##name(Value *out, const Value *av, const Value *bv, uint n) { \
+    for (uint i = 0; i < n; i++) { \
+        Value a = av[i]; \
+        Value b = bv[i]; \
+        out[i] = op; \
+    } \
+}
+
+VECTOR_SCALAR_KERNEL(add, a + b)
+VECTOR_SCALAR_KERNEL(sub, a - b)
+VECTOR_SCALAR_KERNEL(mul, a * b)
+VECTOR_SCALAR_KERNEL(div, a / b)
+VECTOR_SCALAR_KERNEL(max, b > a ? b : a)
+VECTOR_SCALAR_KERNEL(min, b < a ? b : a)
+
+#undef VECTOR_SCALAR_KERNEL
+
+const VectorKernels Vector_scalar_kernels = {
+    "scalar",
+    Vector_scalar_add, Vector_scalar_sub, Vector_scalar_mul, Vector_scalar_div, Vector_scalar_max, Vector_scalar_min,
+    { NULL }
+};
+
+#if defined(__x86_64__)
+
+#define VECTOR_WIDTH 4
+#define VECTOR_NAME(name) Vector_avx2_##name
+#define VECTOR_TARGET __attribute__((target("avx2,fma")))
+#define VECTOR_SQRT(x) ((vdouble)_mm256_sqrt_pd((__m256d)(x)))
+#define VECTOR_KERNELS_NAME "avx2"
+#include "mathvector_kernels.c"
+#undef VECTOR_WIDTH
+#undef VECTOR_NAME
+#undef VECTOR_TARGET
+#undef VECTOR_SQRT
+#undef VECTOR_KERNELS_NAME
+
+#define VECTOR_WIDTH 2
+#define VECTOR_NAME(name) Vector_sse2_##name
+#define VECTOR_TARGET
+#define VECTOR_SQRT(x) ((vdouble)_mm_sqrt_pd((__m128d)(x)))
+#define VECTOR_KERNELS_NAME "sse2"
+#include "mathvector_kernels.c"
+#undef VECTOR_WIDTH
+#undef VECTOR_NAME
+#undef VECTOR_TARGET
+#undef VECTOR_SQRT
+#undef VECTOR_KERNELS_NAME
+
+#endif
+
+const VectorKernels *vector_kernels = NULL;
+
+// Selects kernels by name ("avx2", "sse2", "scalar") or the best supported set for "auto",
+// returns 0 if the requested set is unknown or unsupported by this CPU
+int Vector_select(const char *name) {
+    int automatic = strcmp(name, "auto") == 0;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if ((automatic || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        vector_kernels = &Vector_avx2_kernels;
+        return 1;
+    }
+    if (automatic || strcmp(name, "sse2") == 0) {
+        vector_kernels = &Vector_sse2_kernels;
+        return 1;
+    }
+#endif
+    if (automatic || strcmp(name, "scalar") == 0) {
+        vector_kernels = &Vector_scalar_kernels;
+        return 1;
+    }
+    return 0;
+}
+
+const VectorKernels *Vector_kernels() {
+    if (vector_kernels == NULL) {
+        Vector_select("auto");
+    }
+    return vector_kernels;
+}
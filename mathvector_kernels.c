@@ -0,0 +1,473 @@
+// Vector kernels for the batch evaluator, included once per instruction set by mathvector.c
+// with VECTOR_WIDTH, VECTOR_NAME and VECTOR_TARGET defined.
+// Lanes a kernel cannot handle exactly (huge arguments, domain edges, special values)
+// are recomputed with the scalar libm function.
+
+#define K(name) VECTOR_NAME(name)
+#define KERNEL VECTOR_TARGET static inline __attribute__((always_inline))
+
+typedef Value K(vdouble) __attribute__((vector_size(VECTOR_WIDTH * sizeof(Value))));
+typedef int64_t K(vlong) __attribute__((vector_size(VECTOR_WIDTH * sizeof(Value))));
+
+#define vdouble K(vdouble)
+#define vlong K(vlong)
+
+#define VECTOR_MAGIC 0x1.8p52
+#define VECTOR_MAGIC_BITS 0x4338000000000000LL
+#define VECTOR_ABS_MASK 0x7fffffffffffffffLL
+#define VECTOR_SIGN_MASK ((int64_t)0x8000000000000000ULL)
+
+KERNEL vdouble K(load)(const Value *p, uint lanes) {
+    vdouble v = (vdouble){ 0 } + 1.0;
+    if (lanes == VECTOR_WIDTH) {
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    for (uint i = 0; i < lanes; i++) {
+        v[i] = p[i];
+    }
+    return v;
+}
+
+KERNEL void K(store)(Value *p, vdouble v, uint lanes) {
+    if (lanes == VECTOR_WIDTH) {
+        memcpy(p, &v, sizeof(v));
+        return;
+    }
+    for (uint i = 0; i < lanes; i++) {
+        p[i] = v[i];
+    }
+}
+
+KERNEL vdouble K(select)(vlong mask, vdouble a, vdouble b) {
+    return (vdouble)((mask & (vlong)a) | (~mask & (vlong)b));
+}
+
+KERNEL int K(any)(vlong mask) {
+    int64_t any = 0;
+    for (uint i = 0; i < VECTOR_WIDTH; i++) {
+        any |= mask[i];
+    }
+    return any != 0;
+}
+
+KERNEL vdouble K(fabs)(vdouble x) {
+    return (vdouble)((vlong)x & VECTOR_ABS_MASK);
+}
+
+KERNEL vlong K(sign)(vdouble x) {
+    return (vlong)x & VECTOR_SIGN_MASK;
+}
+
+// round to nearest, only exact for |x| < 2^51
+KERNEL vdouble K(rint_small)(vdouble x) {
+    return (x + VECTOR_MAGIC) - VECTOR_MAGIC;
+}
+
+// integer value of a double already rounded by rint_small
+KERNEL vlong K(to_long)(vdouble n) {
+    return (vlong)(n + VECTOR_MAGIC) - VECTOR_MAGIC_BITS;
+}
+
+KERNEL vdouble K(to_double)(vlong n) {
+    return (vdouble)(n + VECTOR_MAGIC_BITS) - VECTOR_MAGIC;
+}
+
+// arithmetic
+
+#define VECTOR_ARITHMETIC_KERNEL(name, op) \
+VECTOR_TARGET void K(name)(Value *out, const Value *av, const Value *bv, uint n) { \
+    for (uint i = 0; i < n; i += VECTOR_WIDTH) { \
+        const uint lanes = n - i < VECTOR_WIDTH ? n - i : VECTOR_WIDTH; \
+        vdouble a = K(load)(av + i, lanes); \
+        vdouble b = K(load)(bv + i, lanes); \
+        K(store)(out + i, op, lanes); \
+    } \
+}
+
+VECTOR_ARITHMETIC_KERNEL(add, a + b)
+VECTOR_ARITHMETIC_KERNEL(sub, a - b)
+VECTOR_ARITHMETIC_KERNEL(mul, a * b)
+VECTOR_ARITHMETIC_KERNEL(div, a / b)
+VECTOR_ARITHMETIC_KERNEL(max, K(select)(b > a, b, a))
+VECTOR_ARITHMETIC_KERNEL(min, K(select)(b < a, b, a))
+
+// rounding
+
+KERNEL vdouble K(floor_v)(vdouble x, __attribute__((unused)) vlong *fallback) {
+    vlong big = K(fabs)(x) >= 0x1p52;
+    vdouble t = K(rint_small)(x);
+    t = K(select)(t > x, t - 1.0, t);
+    t = (vdouble)((vlong)t | K(sign)(x));
+    return K(select)(big, x, t);
+}
+
+KERNEL vdouble K(ceil_v)(vdouble x, __attribute__((unused)) vlong *fallback) {
+    vlong big = K(fabs)(x) >= 0x1p52;
+    vdouble t = K(rint_small)(x);
+    t = K(select)(t < x, t + 1.0, t);
+    t = (vdouble)((vlong)t | K(sign)(x));
+    return K(select)(big, x, t);
+}
+
+KERNEL vdouble K(round_v)(vdouble x, vlong *fallback) {
+    return K(floor_v)(x + 0.5, fallback);
+}
+
+KERNEL vdouble K(abs_v)(vdouble x, __attribute__((unused)) vlong *fallback) {
+    return K(fabs)(x);
+}
+
+KERNEL vdouble K(sqrt_v)(vdouble x, __attribute__((unused)) vlong *fallback) {
+    return VECTOR_SQRT(x);
+}
+
+// exponential and logarithm
+
+KERNEL vdouble K(exp_core)(vdouble x) {
+    vdouble n = K(rint_small)(x * 1.44269504088896340736);
+    vdouble r = x - n * 6.93147180369123816490e-01 - n * 1.90821492927058770002e-10;
+
+    vdouble p = (vdouble){ 0 } + 1.0 / 6227020800.0;
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    return (vdouble)((vlong)p + (K(to_long)(n) << 52));
+}
+
+KERNEL vdouble K(exp_v)(vdouble x, vlong *fallback) {
+    *fallback |= ~(K(fabs)(x) <= 708.0);
+    return K(exp_core)(x);
+}
+
+// natural logarithm of normal positive numbers
+KERNEL vdouble K(log_core)(vdouble x) {
+    vlong bits = (vlong)x;
+    vlong e = (bits >> 52) - 1023;
+    vdouble m = (vdouble)((bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
+
+    vlong high = m > 1.41421356237309504880;
+    m = K(select)(high, m * 0.5, m);
+    e -= high;
+
+    vdouble dk = K(to_double)(e);
+    vdouble f = m - 1.0;
+    vdouble s = f / (f + 2.0);
+    vdouble z = s * s;
+    vdouble w = z * z;
+    vdouble t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    vdouble t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    vdouble R = t2 + t1;
+    vdouble hfsq = 0.5 * f * f;
+
+    return dk * 6.93147180369123816490e-01 - ((hfsq - (s * (hfsq + R) + dk * 1.90821492927058770002e-10)) - f);
+}
+
+KERNEL vlong K(log_fallback)(vdouble x) {
+    return ~((x >= 0x1p-1022) & (x <= 0x1.fffffffffffffp1023));
+}
+
+KERNEL vdouble K(log_v)(vdouble x, vlong *fallback) {
+    *fallback |= K(log_fallback)(x);
+    return K(log_core)(x);
+}
+
+KERNEL vdouble K(log10_v)(vdouble x, vlong *fallback) {
+    return K(log_v)(x, fallback) / 2.30258509299404568402;
+}
+
+KERNEL vdouble K(logn_v)(vdouble x, vdouble b, vlong *fallback) {
+    *fallback |= K(log_fallback)(x) | K(log_fallback)(b);
+    return K(log_core)(x) / K(log_core)(b);
+}
+
+KERNEL vdouble K(pow_v)(vdouble x, vdouble y, vlong *fallback) {
+    vdouble ay = K(fabs)(y);
+    vlong integer = (ay <= 64.0) & (K(rint_small)(y) == y);
+
+    vdouble result = (vdouble){ 0 } + 1.0;
+    if (K(any)(integer)) {
+        vlong e = K(to_long)(K(select)(integer, ay, (vdouble){ 0 }));
+        vdouble base = x;
+        for (uint k = 0; k < 7; k++) {
+            result = K(select)(-((e >> k) & 1), result * base, result);
+            base *= base;
+        }
+        result = K(select)(y < 0.0, 1.0 / result, result);
+    }
+
+    if (!K(any)(~integer)) {
+        return result;
+    }
+
+    vdouble t = y * K(log_core)(x);
+    vdouble general = K(exp_core)(t);
+    vlong positive = (x >= 0x1p-1022) & (x <= 0x1.fffffffffffffp1023) & (K(fabs)(t) <= 708.0);
+    // a negative base only has a real power for integer exponents, those beyond the integer
+    // path above are left to libm
+    vlong whole = (ay >= 0x1p51) | (K(rint_small)(y) == y);
+    vlong negative = (x < 0.0) & (x >= -0x1.fffffffffffffp1023) & (ay <= 0x1.fffffffffffffp1023) & ~whole;
+
+    general = K(select)(negative, (vdouble){ 0 } + __builtin_nan(""), general);
+    *fallback |= ~integer & ~positive & ~negative;
+
+    return K(select)(integer, result, general);
+}
+
+// trigonometry
+
+// reduces x by multiples of pi/2, q receives the quadrant
+KERNEL vdouble K(reduce_pio2)(vdouble x, vlong *q, vlong *fallback) {
+    *fallback |= ~(K(fabs)(x) <= 1e6);
+    vdouble n = K(rint_small)(x * 6.36619772367581382433e-01);
+    vdouble r = x - n * 1.57079632673412561417e+00;
+    r = r - n * 6.07710050630396597660e-11;
+    r = r - n * 2.02226624879595063154e-21;
+    *q = K(to_long)(n) & 3;
+    return r;
+}
+
+KERNEL vdouble K(sin_poly)(vdouble r) {
+    vdouble z = r * r;
+    vdouble p = (vdouble){ 0 } + 1.0 / 1307674368000.0;
+    p = p * z - 1.0 / 6227020800.0;
+    p = p * z + 1.0 / 39916800.0;
+    p = p * z - 1.0 / 362880.0;
+    p = p * z + 1.0 / 5040.0;
+    p = p * z - 1.0 / 120.0;
+    p = p * z + 1.0 / 6.0;
+    return K(select)(z == 0.0, r, r - r * z * p);
+}
+
+KERNEL vdouble K(cos_poly)(vdouble r) {
+    vdouble z = r * r;
+    vdouble p = (vdouble){ 0 } + 1.0 / 20922789888000.0;
+    p = p * z - 1.0 / 87178291200.0;
+    p = p * z + 1.0 / 479001600.0;
+    p = p * z - 1.0 / 3628800.0;
+    p = p * z + 1.0 / 40320.0;
+    p = p * z - 1.0 / 720.0;
+    p = p * z + 1.0 / 24.0;
+    return 1.0 - 0.5 * z + z * z * p;
+}
+
+KERNEL vdouble K(sin_v)(vdouble x, vlong *fallback) {
+    vlong q;
+    vdouble r = K(reduce_pio2)(x, &q, fallback);
+    vdouble s = K(sin_poly)(r);
+    vdouble c = K(cos_poly)(r);
+    vdouble v = K(select)((q & 1) != 0, c, s);
+    return (vdouble)((vlong)v ^ ((q & 2) << 62));
+}
+
+KERNEL vdouble K(cos_v)(vdouble x, vlong *fallback) {
+    vlong q;
+    vdouble r = K(reduce_pio2)(x, &q, fallback);
+    vdouble s = K(sin_poly)(r);
+    vdouble c = K(cos_poly)(r);
+    vdouble v = K(select)((q & 1) != 0, s, c);
+    return (vdouble)((vlong)v ^ (((q + 1) & 2) << 62));
+}
+
+KERNEL vdouble K(tan_v)(vdouble x, vlong *fallback) {
+    vlong q;
+    vdouble r = K(reduce_pio2)(x, &q, fallback);
+    vdouble s = K(sin_poly)(r);
+    vdouble c = K(cos_poly)(r);
+    return K(select)((q & 1) != 0, -c / s, s / c);
+}
+
+// atan of |t| <= tan(pi / 8), halved once more so the series converges quickly
+KERNEL vdouble K(atan_core)(vdouble t) {
+    vdouble u = t / (1.0 + K(sqrt_v)(1.0 + t * t, NULL));
+    vdouble z = u * u;
+    vdouble p = (vdouble){ 0 } + 1.0 / 25.0;
+    p = p * z - 1.0 / 23.0;
+    p = p * z + 1.0 / 21.0;
+    p = p * z - 1.0 / 19.0;
+    p = p * z + 1.0 / 17.0;
+    p = p * z - 1.0 / 15.0;
+    p = p * z + 1.0 / 13.0;
+    p = p * z - 1.0 / 11.0;
+    p = p * z + 1.0 / 9.0;
+    p = p * z - 1.0 / 7.0;
+    p = p * z + 1.0 / 5.0;
+    p = p * z - 1.0 / 3.0;
+    return 2.0 * (u + u * z * p);
+}
+
+KERNEL vdouble K(atan_v)(vdouble x, __attribute__((unused)) vlong *fallback) {
+    vdouble a = K(fabs)(x);
+    vlong big = a > 2.41421356237309504880;
+    vlong mid = (a > 0.41421356237309504880) & ~big;
+
+    vdouble t = K(select)(big, -1.0 / a, K(select)(mid, (a - 1.0) / (a + 1.0), a));
+    vdouble base = K(select)(big, (vdouble){ 0 } + 1.57079632679489661923, K(select)(mid, (vdouble){ 0 } + 0.78539816339744830962, (vdouble){ 0 }));
+
+    vdouble r = base + K(atan_core)(t);
+    return (vdouble)((vlong)r | K(sign)(x));
+}
+
+KERNEL vdouble K(atan2_v)(vdouble y, vdouble x, vlong *fallback) {
+    *fallback |= (x == 0.0) | (y == 0.0) | ~(K(fabs)(x) <= 0x1.fffffffffffffp1023) | ~(K(fabs)(y) <= 0x1.fffffffffffffp1023);
+    vdouble r = K(atan_v)(y / x, fallback);
+    vdouble pi = (vdouble)(K(sign)(y) | (vlong)((vdouble){ 0 } + 3.14159265358979323846));
+    return K(select)(x < 0.0, r + pi, r);
+}
+
+KERNEL vdouble K(asin_v)(vdouble x, vlong *fallback) {
+    *fallback |= ~(K(fabs)(x) < 1.0);
+    return K(atan_v)(x / K(sqrt_v)((1.0 - x) * (1.0 + x), NULL), fallback);
+}
+
+KERNEL vdouble K(acos_v)(vdouble x, vlong *fallback) {
+    *fallback |= ~(K(fabs)(x) < 1.0);
+    return 2.0 * K(atan_v)(K(sqrt_v)((1.0 - x) / (1.0 + x), NULL), fallback);
+}
+
+// hyperbolic functions
+
+KERNEL vdouble K(sinh_series)(vdouble x) {
+    vdouble z = x * x;
+    vdouble p = (vdouble){ 0 } + 1.0 / 121645100408832000.0;
+    p = p * z + 1.0 / 355687428096000.0;
+    p = p * z + 1.0 / 1307674368000.0;
+    p = p * z + 1.0 / 6227020800.0;
+    p = p * z + 1.0 / 39916800.0;
+    p = p * z + 1.0 / 362880.0;
+    p = p * z + 1.0 / 5040.0;
+    p = p * z + 1.0 / 120.0;
+    p = p * z + 1.0 / 6.0;
+    return x + x * z * p;
+}
+
+KERNEL vdouble K(sinh_v)(vdouble x, vlong *fallback) {
+    vdouble a = K(fabs)(x);
+    *fallback |= ~(a <= 700.0);
+    vdouble e = K(exp_core)(a);
+    vdouble large = (vdouble)((vlong)(0.5 * (e - 1.0 / e)) | K(sign)(x));
+    return K(select)(a < 1.0, K(sinh_series)(x), large);
+}
+
+KERNEL vdouble K(cosh_v)(vdouble x, vlong *fallback) {
+    vdouble a = K(fabs)(x);
+    *fallback |= ~(a <= 700.0);
+    vdouble e = K(exp_core)(a);
+    return 0.5 * (e + 1.0 / e);
+}
+
+KERNEL vdouble K(tanh_v)(vdouble x, vlong *fallback) {
+    vdouble a = K(fabs)(x);
+    *fallback |= a != a;
+    vdouble s = K(sinh_series)(a);
+    vdouble small = s / K(sqrt_v)(1.0 + s * s, NULL);
+    vdouble large = 1.0 - 2.0 / (K(exp_core)(K(select)(a > 22.0, (vdouble){ 0 }, 2.0 * a)) + 1.0);
+    vdouble r = K(select)(a < 1.0, small, K(select)(a > 22.0, (vdouble){ 0 } + 1.0, large));
+    return (vdouble)((vlong)r | K(sign)(x));
+}
+
+// array drivers
+
+#define VECTOR_UNARY_KERNEL(name, scalar) \
+VECTOR_TARGET void K(name)(Value *out, const Value *a, uint n) { \
+    for (uint i = 0; i < n; i += VECTOR_WIDTH) { \
+        const uint lanes = n - i < VECTOR_WIDTH ? n - i : VECTOR_WIDTH; \
+        vdouble x = K(load)(a + i, lanes); \
+        vlong fallback = { 0 }; \
+        K(store)(out + i, K(name##_v)(x, &fallback), lanes); \
+        if (K(any)(fallback)) { \
+            for (uint l = 0; l < lanes; l++) { \
+                if (fallback[l]) { \
+                    out[i + l] = scalar(x[l]); \
+                } \
+            } \
+        } \
+    } \
+}
+
+#define VECTOR_BINARY_KERNEL(name, scalar) \
+VECTOR_TARGET void K(name)(Value *out, const Value *a, const Value *b, uint n) { \
+    for (uint i = 0; i < n; i += VECTOR_WIDTH) { \
+        const uint lanes = n - i < VECTOR_WIDTH ? n - i : VECTOR_WIDTH; \
+        vdouble x = K(load)(a + i, lanes); \
+        vdouble y = K(load)(b + i, lanes); \
+        vlong fallback = { 0 }; \
+        K(store)(out + i, K(name##_v)(x, y, &fallback), lanes); \
+        if (K(any)(fallback)) { \
+            for (uint l = 0; l < lanes; l++) { \
+                if (fallback[l]) { \
+                    out[i + l] = scalar(x[l], y[l]); \
+                } \
+            } \
+        } \
+    } \
+}
+
+VECTOR_UNARY_KERNEL(sqrt, sqrt)
+VECTOR_UNARY_KERNEL(abs, fabs)
+VECTOR_UNARY_KERNEL(floor, floor)
+VECTOR_UNARY_KERNEL(ceil, ceil)
+VECTOR_UNARY_KERNEL(round, Vector_scalar_round)
+VECTOR_UNARY_KERNEL(log, log)
+VECTOR_UNARY_KERNEL(log10, log10)
+VECTOR_UNARY_KERNEL(sin, sin)
+VECTOR_UNARY_KERNEL(cos, cos)
+VECTOR_UNARY_KERNEL(tan, tan)
+VECTOR_UNARY_KERNEL(sinh, sinh)
+VECTOR_UNARY_KERNEL(cosh, cosh)
+VECTOR_UNARY_KERNEL(tanh, tanh)
+VECTOR_UNARY_KERNEL(asin, asin)
+VECTOR_UNARY_KERNEL(acos, acos)
+VECTOR_UNARY_KERNEL(atan, atan)
+VECTOR_BINARY_KERNEL(pow, pow)
+VECTOR_BINARY_KERNEL(atan2, atan2)
+VECTOR_BINARY_KERNEL(logn, Vector_scalar_logn)
+
+const VectorKernels K(kernels) = {
+    VECTOR_KERNELS_NAME,
+    K(add), K(sub), K(mul), K(div), K(max), K(min),
+    {
+        [VK_SQRT] = K(sqrt),
+        [VK_ABS] = K(abs),
+        [VK_FLOOR] = K(floor),
+        [VK_CEIL] = K(ceil),
+        [VK_ROUND] = K(round),
+        [VK_LOG] = K(log),
+        [VK_LOG10] = K(log10),
+        [VK_SIN] = K(sin),
+        [VK_COS] = K(cos),
+        [VK_TAN] = K(tan),
+        [VK_SINH] = K(sinh),
+        [VK_COSH] = K(cosh),
+        [VK_TANH] = K(tanh),
+        [VK_ASIN] = K(asin),
+        [VK_ACOS] = K(acos),
+        [VK_ATAN] = K(atan),
+        [VK_POW] = K(pow),
+        [VK_ATAN2] = K(atan2),
+        [VK_LOGN] = K(logn),
+    }
+};
+
+#undef VECTOR_UNARY_KERNEL
+#undef VECTOR_BINARY_KERNEL
+#undef VECTOR_ARITHMETIC_KERNEL
+#undef VECTOR_MAGIC
+#undef VECTOR_MAGIC_BITS
+#undef VECTOR_ABS_MASK
+#undef VECTOR_SIGN_MASK
+#undef vdouble
+#undef vlong
+#undef KERNEL
+#undef K
@@ -1,12 +1,26 @@
+#pragma push_macro("main")
+#undef main
 #define main mathengine_main
 #include "mathimpl.c"
-#undef main
+#pragma pop_macro("main")
 
 #include "bmp.c"
+#include "svg.c"
+#include "workpool.c"
+#include "contour.c"
+#include "trace.c"
 
 #include <malloc.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
 
+#include "tilecache.c"
 #include "plottercfg.h"
 
 void blend_alpha(BMP_color *pixel, BMP_color color, double alpha) {
@@ -16,9 +30,25 @@ void blend_alpha(BMP_color *pixel, BMP_color color, double alpha) {
     pixel->blue += ((int)pixel->blue - (int)color.blue) * alpha;
 }
 
-void render_dot(int size, BMP_color color, double alpha, BMP_color *framebuffer, int w, int h, int x, int y) {
-    if (size == 1) {
-        blend_alpha(&framebuffer[y * w + x], color, alpha);
+// Rows [y0, y0 + rows) of a w * h image, plots draw in image coordinates and anything
+// outside of the band is clipped. Row y0 + 1 starts stride bytes after row y0
+typedef struct {
+    BMP_color *pixels;
+    size_t stride;
+    int w;
+    int h;
+    int y0;
+    int rows;
+} Band;
+
+BMP_color *Band_pixel(Band *this, int x, int y) {
+    return (BMP_color*)((char*)this->pixels + (size_t)(y - this->y0) * this->stride) + x;
+}
+
+void render_dot(int size, BMP_color color, double alpha, Band *band, int x, int y) {
+    const int y1 = band->y0 + band->rows;
+    if (size == 1 && y >= band->y0 && y < y1) {
+        blend_alpha(Band_pixel(band, x, y), color, alpha);
     }
 
     int xo = x - size / 2;
@@ -26,53 +56,746 @@ void render_dot(int size, BMP_color color, double alpha, BMP_color *framebuffer,
     int xt = xo + size;
     int yt = yo + size; 
     if (xo < 0) { xo = 0; }
-    if (yo < 0) { yo = 0; }
-    if (xt >= w) { xt = w; }
-    if (yt >= w) { yt = h; }
+    if (yo < band->y0) { yo = band->y0; }
+    if (xt >= band->w) { xt = band->w; }
+    if (yt >= y1) { yt = y1; }
 
     for (int ya = yo; ya < yt; ya++) {
         for (int xa = xo; xa < xt; xa++) {
-            blend_alpha(&framebuffer[ya * w + xa], color, alpha);
+            blend_alpha(Band_pixel(band, xa, ya), color, alpha);
         }
     }
 }
 
-void plot_function(Expression function, BMP_color color, BMP_color *framebuffer, int w, int h, Value scale, int step, int size) {
-    const int halfw = w / 2;
-    const int halfh = h / 2;
-    
+// Framebuffer colors are kept in BMP byte order, blue first
+#define SVG_COLOR(color) (color).blue, (color).green, (color).red
+
+// Blends a line between pixel space points into alpha which holds rows [ay0, ay0 + rows) of a
+// w wide image, pixels keep the highest coverage of any line through them so joined segments
+// don't darken their shared ends
+void render_line(double *alpha, int w, int ay0, int rows, double x0, double y0, double x1, double y1) {
+    // pixel (x, y) is centered at (x + 0.5, y + 0.5)
+    x0 -= 0.5;
+    y0 -= 0.5;
+    x1 -= 0.5;
+    y1 -= 0.5;
+
+    const int steep = fabs(y1 - y0) > fabs(x1 - x0);
+    if (steep) {
+        double t = x0; x0 = y0; y0 = t;
+        t = x1; x1 = y1; y1 = t;
+    }
+    if (x0 > x1) {
+        double t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+
+    const double gradient = x1 - x0 > 0 ? (y1 - y0) / (x1 - x0) : 0;
+    const int xe = (int)floor(x1 + 0.5);
+    for (int x = (int)floor(x0 + 0.5); x <= xe; x++) {
+        const double y = y0 + gradient * (x - x0);
+        const int yi = (int)floor(y);
+        const double f = y - yi;
+        for (int k = 0; k < 2; k++) {
+            const int px = steep ? yi + k : x;
+            const int py = steep ? x : yi + k;
+            const double coverage = k ? f : 1 - f;
+            if (px < 0 || py < ay0 || px >= w || py >= ay0 + rows) {
+                continue;
+            }
+            double *pixel = &alpha[(size_t)(py - ay0) * w + px];
+            if (*pixel < coverage) {
+                *pixel = coverage;
+            }
+        }
+    }
+}
+
+// Programs compiled for earlier jobs of batch mode, keyed by the backend, the vector kernels and
+// the canonical form of the expression. The least recently used entry no evaluator is using
+// makes room for a new one
+typedef struct {
+    char *key;
+    Program *program;
+    // backend the program runs on after any fallback
+    enum Backend backend;
+    uint users;
+    unsigned long used;
+} ProgramCacheEntry;
+
+typedef struct {
+    ProgramCacheEntry *entries;
+    uint count;
+    uint capacity;
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+} ProgramCache;
+
+// Only set in batch mode
+ProgramCache *program_cache = NULL;
+
+ProgramCache *ProgramCache_create(uint capacity) {
+    ProgramCache *this = malloc(sizeof(ProgramCache));
+    this->entries = malloc(sizeof(ProgramCacheEntry) * (capacity ? capacity : 1));
+    this->count = 0;
+    this->capacity = capacity;
+    this->clock = 0;
+    this->hits = 0;
+    this->misses = 0;
+    return this;
+}
+
+// Returns the entry for key with one more user, or NULL
+ProgramCacheEntry *ProgramCache_acquire(ProgramCache *this, const char *key) {
+    for (uint i = 0; i < this->count; i++) {
+        ProgramCacheEntry *entry = &this->entries[i];
+        if (strcmp(entry->key, key) == 0) {
+            entry->users++;
+            entry->used = ++this->clock;
+            this->hits++;
+            return entry;
+        }
+    }
+    this->misses++;
+    return NULL;
+}
+
+// Hands program over to the cache and returns its entry with one user, or NULL if every
+// entry is in use and the caller keeps the program
+ProgramCacheEntry *ProgramCache_insert(ProgramCache *this, char *key, Program *program, enum Backend backend) {
+    ProgramCacheEntry *entry = NULL;
+    if (this->count < this->capacity) {
+        entry = &this->entries[this->count++];
+    } else {
+        for (uint i = 0; i < this->count; i++) {
+            ProgramCacheEntry *candidate = &this->entries[i];
+            if (candidate->users == 0 && (entry == NULL || candidate->used < entry->used)) {
+                entry = candidate;
+            }
+        }
+        if (entry == NULL) {
+            return NULL;
+        }
+        free(entry->key);
+        Program_free(entry->program);
+    }
+
+    entry->key = key;
+    entry->program = program;
+    entry->backend = backend;
+    entry->users = 1;
+    entry->used = ++this->clock;
+    return entry;
+}
+
+void ProgramCache_free(ProgramCache *this) {
+    for (uint i = 0; i < this->count; i++) {
+        free(this->entries[i].key);
+        Program_free(this->entries[i].program);
+    }
+    free(this->entries);
+    free(this);
+}
+
+// Evaluates an expression of x and y through the selected backend,
+// the interpreter is only used when compilation is unavailable.
+// Forked evaluators share the program of their source and only own their context,
+// a program taken from the program cache is owned by the cache
+typedef struct {
+    enum Backend backend;
+    Expression expression;
     State state;
-    State_init(&state);
-    state.vars['x'].occupied = 1;
+    Program *program;
+    ProgramCacheEntry *cached;
+    ProgramContext *context;
+    int forked;
+    Value *xp;
+    Value *yp;
+    Value unused;
+    Interval vars[MATH_MAX_VARS];
+} Evaluator;
+
+void Evaluator_bind(Evaluator *this);
+
+// Creates the cache directory if needed, returns NULL when there is nowhere to put it
+const char *cache_path() {
+    static char path[PATH_MAX];
+    if (cache_directory) {
+        return mkdir(cache_directory, 0755) == 0 || errno == EEXIST ? cache_directory : NULL;
+    }
+
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) {
+        snprintf(path, sizeof(path), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    mkdir(path, 0755);
+    strncat(path, "/plotter", sizeof(path) - strlen(path) - 1);
+    return mkdir(path, 0755) == 0 || errno == EEXIST ? path : NULL;
+}
 
-    Value *xp = &state.vars['x'].value;
+// Builds the program of an evaluator into a library with the system compiler
+char *Evaluator_cc(Evaluator *this) {
+    const char *directory = cache_path();
+    if (directory == NULL) {
+        char *error = malloc(64);
+        sprintf(error, "No cache directory");
+        return error;
+    }
+    char *canonical = canonicalExpression(this->expression, &this->state);
+    char *error = Program_cc(this->program, canonical, directory);
+    free(canonical);
+    return error;
+}
 
-    *xp = 0;
+// Value of sweep_variable in the image being rendered
+Value sweep_value = 0;
 
-    Result r = Expression_evaluate(function, &state);
+// Compilation notes go to log unless it is NULL. A swept variable is left out of constant
+// folding, so its program is the same for every frame and found in the program cache
+char *Evaluator_init(Evaluator *this, Expression expression, enum Backend backend, FILE *log) {
+    this->backend = backend;
+    this->expression = expression;
+    this->program = NULL;
+    this->cached = NULL;
+    this->context = NULL;
+    this->forked = 0;
+
+    State_init(&this->state);
+    this->state.vars['x'].occupied = 1;
+    this->state.vars['y'].occupied = 1;
+    this->state.vars['x'].value = 0;
+    this->state.vars['y'].value = 0;
+
+    this->xp = &this->state.vars['x'].value;
+    this->yp = &this->state.vars['y'].value;
+
+    if (sweep_frames > 0) {
+        this->state.vars[sweep_variable].occupied = 1;
+        this->state.vars[sweep_variable].value = sweep_value;
+    }
+
+    Result r = Expression_evaluate(expression, &this->state);
     if (r.error) {
-        fprintf(stderr, "Evaluation error: %s\n", r.error);
-        free(r.error);
+        return r.error;
+    }
+
+    State_intervals(&this->state, this->vars);
+
+    if (backend == BACKEND_INTERPRETER) {
+        return NULL;
+    }
+
+    char *key = NULL;
+    if (program_cache) {
+        char *canonical = canonicalExpression(expression, &this->state);
+        const char *kernels = Vector_kernels()->name;
+        key = malloc(strlen(canonical) + strlen(kernels) + 16);
+        sprintf(key, "%d %s %s", backend, kernels, canonical);
+        free(canonical);
+
+        this->cached = ProgramCache_acquire(program_cache, key);
+        if (this->cached) {
+            free(key);
+            this->program = this->cached->program;
+            this->backend = this->cached->backend;
+            if (log) {
+                fprintf(log, "Reusing the compiled program of an earlier image\n");
+            }
+            Evaluator_bind(this);
+            return NULL;
+        }
+    }
+
+    Arena arena;
+    Arena_init(&arena);
+    CompilationContext ctx = { &this->state, &arena };
+    CompilationResult cr = compileExpression(expression, ctx);
+    if (cr.error) {
+        if (log) {
+            fprintf(log, "%s, falling back to interpreter\n", cr.error);
+        }
+        free(cr.error);
+        free(key);
+        Arena_free(&arena);
+        this->backend = BACKEND_INTERPRETER;
+        return NULL;
+    }
+
+    this->program = Program_create(cr);
+    Arena_free(&arena);
+
+    if (log) {
+        fprintf(log, "Compiled to %u instructions using %u registers, %u subexpressions deduplicated\n",
+            this->program->code_length - 1, this->program->register_count, this->program->deduplicated);
+    }
+
+    if (backend == BACKEND_JIT) {
+        char *error = Program_jit(this->program);
+        if (error) {
+            if (log) {
+                fprintf(log, "%s, falling back to compiled\n", error);
+            }
+            free(error);
+            this->backend = BACKEND_COMPILED;
+        } else if (log) {
+            fprintf(log, "Generated %u bytes of native code\n", this->program->native_size);
+        }
+    }
+
+    if (backend == BACKEND_CC) {
+        char *error = Evaluator_cc(this);
+        if (error) {
+            if (log) {
+                fprintf(log, "%s, falling back to batch\n", error);
+            }
+            free(error);
+            this->backend = BACKEND_BATCH;
+        } else if (log) {
+            fprintf(log, "Loaded expression compiled by " MATH_CC "\n");
+        }
+    }
+
+    if (key) {
+        this->cached = ProgramCache_insert(program_cache, key, this->program, this->backend);
+        if (this->cached == NULL) {
+            free(key);
+        }
+    }
+
+    Evaluator_bind(this);
+
+    return NULL;
+}
+
+// Gives an evaluator with a program its own registers and points xp and yp at them,
+// a swept variable gets its value from the state
+void Evaluator_bind(Evaluator *this) {
+    this->context = ProgramContext_create(this->program);
+    if (sweep_frames > 0) {
+        Value *sweep = ProgramContext_variable(this->context, this->program, sweep_variable);
+        if (sweep) {
+            *sweep = this->state.vars[sweep_variable].value;
+        }
+    }
+    this->xp = ProgramContext_variable(this->context, this->program, 'x');
+    this->yp = ProgramContext_variable(this->context, this->program, 'y');
+    if (this->xp == NULL) {
+        this->xp = &this->unused;
+    }
+    if (this->yp == NULL) {
+        this->yp = &this->unused;
+    }
+}
+
+// Initializes this as a copy of source sharing its compiled program
+void Evaluator_fork(Evaluator *this, const Evaluator *source) {
+    *this = *source;
+    this->forked = 1;
+    this->xp = &this->state.vars['x'].value;
+    this->yp = &this->state.vars['y'].value;
+    if (this->program) {
+        Evaluator_bind(this);
+    }
+}
+
+void Evaluator_destroy(Evaluator *this) {
+    if (this->context) {
+        ProgramContext_free(this->context);
+    }
+    if (this->cached && !this->forked) {
+        this->cached->users--;
+    } else if (this->program && !this->forked) {
+#ifdef MATH_PROFILE
+        Program_print_profile(this->program, this->expression, &this->state, stderr);
+#endif
+        Program_free(this->program);
+    }
+}
+
+Value Evaluator_evaluate(Evaluator *this) {
+    if (this->program) {
+        return Program_execute(this->program, this->context);
+    }
+
+    Result r = Expression_evaluate(this->expression, &this->state);
+    free(r.error);
+    return r.value;
+}
+
+// Value and gradient at the current point. The interpreter has no dual numbers, it
+// takes the gradient by central differences over step
+Dual Evaluator_evaluate_dual(Evaluator *this, Value step) {
+    if (this->program) {
+        return Program_execute_dual(this->program, this->context, 'x', 'y');
+    }
+
+    Dual result;
+    result.v = Evaluator_evaluate(this);
+    const Value x = *this->xp;
+    const Value y = *this->yp;
+    *this->xp = x + step;
+    result.dx = Evaluator_evaluate(this);
+    *this->xp = x - step;
+    result.dx = (result.dx - Evaluator_evaluate(this)) / (2 * step);
+    *this->xp = x;
+    *this->yp = y + step;
+    result.dy = Evaluator_evaluate(this);
+    *this->yp = y - step;
+    result.dy = (result.dy - Evaluator_evaluate(this)) / (2 * step);
+    *this->yp = y;
+    return result;
+}
+
+// Evaluates count points at once, a NULL xs or ys keeps the current value of that variable
+void Evaluator_evaluate_batch(Evaluator *this, const Value *xs, const Value *ys, Value *out, uint count) {
+    if (this->backend == BACKEND_BATCH || this->backend == BACKEND_CC) {
+        const Value *inputs[MATH_MAX_VARS] = { NULL };
+        inputs['x'] = xs;
+        inputs['y'] = ys;
+        Program_execute_batch(this->program, this->context, inputs, out, count);
         return;
     }
 
-    for (int x = 0; x < w; x+=step) {
-        *xp = (Value)(x - halfw) / scale;
-        Result r = Expression_evaluate(function, &state);
-        int y = (int)((r.value) * scale) + halfh;
-        //fprintf(stderr, "x: %i y: %i xv: %lf yv: %lf\n", x, y, *xp, r.value);
-        if (y < 0 || y >= h) {
+    for (uint i = 0; i < count; i++) {
+        if (xs) {
+            *this->xp = xs[i];
+        }
+        if (ys) {
+            *this->yp = ys[i];
+        }
+        out[i] = Evaluator_evaluate(this);
+    }
+}
+
+// Sets up an evaluator for each of count workers, returns NULL on failure
+Evaluator *Evaluator_create_workers(Expression expression, enum Backend backend, uint count) {
+    Evaluator *evs = malloc(sizeof(Evaluator) * count);
+    char *error = Evaluator_init(&evs[0], expression, backend, stderr);
+    if (error) {
+        fprintf(stderr, "Evaluation error: %s\n", error);
+        free(error);
+        free(evs);
+        return NULL;
+    }
+
+    for (uint i = 1; i < count; i++) {
+        Evaluator_fork(&evs[i], &evs[0]);
+    }
+    return evs;
+}
+
+void Evaluator_destroy_workers(Evaluator *evs, uint count) {
+    // forks share the program of the first evaluator, it goes last
+    for (uint i = count; i-- > 0;) {
+        Evaluator_destroy(&evs[i]);
+    }
+    free(evs);
+}
+
+uint plot_threads() {
+    return threads > 0 ? (uint)threads : WorkPool_default_threads();
+}
+
+// Encloses the values of the expression over the rectangle x * y
+Interval Evaluator_evaluate_interval(Evaluator *this, Interval x, Interval y) {
+    this->vars['x'] = x;
+    this->vars['y'] = y;
+    return Expression_evaluateInterval(this->expression, this->vars);
+}
+
+#define PLOT_FUNCTION_CHUNK 64
+
+typedef struct {
+    Evaluator *evs;
+    const Value *xs;
+    Value *ys;
+    uint count;
+} FunctionJob;
+
+void FunctionJob_run(void *vthis, uint worker, uint task) {
+    FunctionJob *this = vthis;
+    const uint begin = task * PLOT_FUNCTION_CHUNK;
+    const uint end = begin + PLOT_FUNCTION_CHUNK < this->count ? begin + PLOT_FUNCTION_CHUNK : this->count;
+    Evaluator_evaluate_batch(&this->evs[worker], this->xs + begin, NULL, this->ys + begin, end - begin);
+}
+
+// Evaluates the function at every step'th column of the image, returns NULL on failure
+Value *plot_function_sample(Expression function, int w, Value scale, int step) {
+    const int halfw = w / 2;
+
+    const uint count = (w + step - 1) / step;
+    const uint tasks = (count + PLOT_FUNCTION_CHUNK - 1) / PLOT_FUNCTION_CHUNK;
+    uint workers = plot_threads();
+    if (workers > tasks) {
+        workers = tasks;
+    }
+
+    Evaluator *evs = Evaluator_create_workers(function, backend, workers);
+    if (evs == NULL) {
+        return NULL;
+    }
+
+    Value *xs = malloc(sizeof(Value) * count);
+    Value *ys = malloc(sizeof(Value) * count);
+
+    for (uint i = 0; i < count; i++) {
+        xs[i] = (Value)((int)i * step - halfw) / scale + center_x;
+    }
+
+    FunctionJob job = { evs, xs, ys, count };
+    WorkPool_run(workers, tasks, FunctionJob_run, &job);
+
+    free(xs);
+    Evaluator_destroy_workers(evs, workers);
+    return ys;
+}
+
+// Draws the dots of the sampled function that reach into band
+void plot_function_band(const Value *ys, BMP_color color, Band *band, Value scale, int step, int size) {
+    const int halfh = band->h / 2;
+    const uint count = (band->w + step - 1) / step;
+
+    for (uint i = 0; i < count; i++) {
+        const int x = i * step;
+        int y = (int)((ys[i] - center_y) * scale) + halfh;
+        //fprintf(stderr, "x: %i y: %i xv: %lf yv: %lf\n", x, y, xs[i], ys[i]);
+        if (y < 0 || y >= band->h) {
             continue;
         }
-        render_dot(size, color, 1, framebuffer, w, h, x, y);
+        render_dot(size, color, 1, band, x, y);
     }
 }
 
+// Writes the sampled function as polylines broken wherever it leaves the image
+void plot_function_svg(const Value *ys, BMP_color color, FILE *svg, int w, int h, Value scale, int step) {
+    const int halfh = h / 2;
+    const uint count = (w + step - 1) / step;
 
-double refine_equation(Expression equation, State *state, Value *xp, Value *yp, Value treshold, Value pixel_size, int depth) {
-    Result r = Expression_evaluate(equation, state);
+    int open = 0;
+    for (uint i = 0; i < count; i++) {
+        const Value v = (ys[i] - center_y) * scale + halfh;
+        if (!isfinite(v) || v < 0 || v > h) {
+            if (open) {
+                SVG_polyline_end(svg);
+                open = 0;
+            }
+            continue;
+        }
+        if (!open) {
+            SVG_polyline_begin(svg, SVG_COLOR(color));
+            open = 1;
+        }
+        SVG_point(svg, i * step, h - v);
+    }
+    if (open) {
+        SVG_polyline_end(svg);
+    }
+}
+
+
+// Adaptive sampling starts from a sample every FUNCTION_SPACING columns and halves intervals
+// down to FUNCTION_MIN_WIDTH pixels
+#define FUNCTION_SPACING 4
+#define FUNCTION_MIN_WIDTH (1.0 / 64)
+// pixels the middle of an interval may stray from the line between its ends
+#define FUNCTION_TOLERANCE 0.5
+// initial intervals refined by each task
+#define FUNCTION_TASK_INTERVALS 16
+
+typedef struct {
+    Evaluator *evs;
+    Value halfw;
+    Value halfh;
+    Value scale;
+    int w;
+    uint intervals;
+    // points of each task in pixel space, a point without a finite y breaks the curve
+    TraceBuffer *buffers;
+    uint *evaluations;
+} AdaptiveJob;
+
+// Row in pixel space of the function at column p
+Value AdaptiveJob_evaluate(AdaptiveJob *this, Evaluator *ev, Value p) {
+    *ev->xp = (p - this->halfw) / this->scale + center_x;
+    return (Evaluator_evaluate(ev) - center_y) * this->scale + this->halfh;
+}
+
+// Appends the curve over (a, b] to buffer. An interval is halved while its middle strays from
+// the line between its ends, which covers both sharp bends and large jumps between consecutive
+// samples. Below a pixel only intervals that don't look linear are halved, and one that still
+// doesn't at the smallest width is an asymptote or a discontinuity and breaks the curve
+void AdaptiveJob_refine(AdaptiveJob *this, Evaluator *ev, uint task, Value a, Value fa, Value b, Value fb) {
+    TraceBuffer *buffer = &this->buffers[task];
+    const Value m = (a + b) * 0.5;
+    const Value fm = AdaptiveJob_evaluate(this, ev, m);
+    this->evaluations[task]++;
+
+    const int finite = isfinite(fa) + isfinite(fm) + isfinite(fb);
+    const Value jump = Value_fabs(fb - fa);
+    const Value deviation = Value_fabs(fm - (fa + fb) * 0.5);
+    const int linear = finite == 3 && deviation <= FUNCTION_TOLERANCE + jump * 0.25;
+
+    int split;
+    if (finite != 3) {
+        // the curve ends somewhere inside
+        split = finite > 0;
+    } else if (b - a > 1) {
+        split = deviation > FUNCTION_TOLERANCE;
+    } else {
+        split = !linear;
+    }
+
+    if (split && b - a > FUNCTION_MIN_WIDTH) {
+        AdaptiveJob_refine(this, ev, task, a, fa, m, fm);
+        AdaptiveJob_refine(this, ev, task, m, fm, b, fb);
+        return;
+    }
+
+    ContourPoint point = { m, linear ? fm : NAN };
+    TraceBuffer_push(buffer, point);
+    point.x = b;
+    point.y = fb;
+    TraceBuffer_push(buffer, point);
+}
+
+// Samples intervals [task * FUNCTION_TASK_INTERVALS, (task + 1) * FUNCTION_TASK_INTERVALS)
+void AdaptiveJob_run(void *vthis, uint worker, uint task) {
+    AdaptiveJob *this = vthis;
+    Evaluator *ev = &this->evs[worker];
+    const uint begin = task * FUNCTION_TASK_INTERVALS;
+    const uint end = begin + FUNCTION_TASK_INTERVALS < this->intervals ? begin + FUNCTION_TASK_INTERVALS : this->intervals;
+
+    Value ps[FUNCTION_TASK_INTERVALS + 1];
+    Value xs[FUNCTION_TASK_INTERVALS + 1];
+    Value fs[FUNCTION_TASK_INTERVALS + 1];
+    for (uint i = begin; i <= end; i++) {
+        ps[i - begin] = i * FUNCTION_SPACING < this->w ? i * FUNCTION_SPACING : this->w;
+        xs[i - begin] = (ps[i - begin] - this->halfw) / this->scale + center_x;
+    }
+    Evaluator_evaluate_batch(ev, xs, NULL, fs, end - begin + 1);
+    this->evaluations[task] += end - begin + 1;
+
+    for (uint i = 0; i <= end - begin; i++) {
+        fs[i] = (fs[i] - center_y) * this->scale + this->halfh;
+    }
+    ContourPoint first = { ps[0], fs[0] };
+    TraceBuffer_push(&this->buffers[task], first);
+    for (uint i = 0; i < end - begin; i++) {
+        AdaptiveJob_refine(this, ev, task, ps[i], fs[i], ps[i + 1], fs[i + 1]);
+    }
+}
+
+// Appends point to the last polyline of curve, or starts a new one with it
+void plot_curve_append(Contours *this, TraceBuffer *points, ContourPoint point, int open) {
+    if (!open) {
+        this->offsets = realloc(this->offsets, sizeof(uint) * (this->polyline_count + 2));
+        this->offsets[this->polyline_count] = points->length;
+    }
+    TraceBuffer_push(points, point);
+}
+
+// Samples the function adaptively and joins the samples into polylines in pixel space, clipped
+// a pixel above and below the image. Returns 0 on failure
+int plot_function_adapt(Expression function, Contours *curve, int w, int h, Value scale) {
+    const uint intervals = (w + FUNCTION_SPACING - 1) / FUNCTION_SPACING;
+    const uint tasks = (intervals + FUNCTION_TASK_INTERVALS - 1) / FUNCTION_TASK_INTERVALS;
+    uint workers = plot_threads();
+    if (workers > tasks) {
+        workers = tasks;
+    }
+
+    Evaluator *evs = Evaluator_create_workers(function, backend, workers);
+    if (evs == NULL) {
+        return 0;
+    }
+
+    AdaptiveJob job = {
+        evs, w / 2, h / 2, scale, w, intervals,
+        calloc(tasks, sizeof(TraceBuffer)), calloc(tasks, sizeof(uint))
+    };
+    WorkPool_run(workers, tasks, AdaptiveJob_run, &job);
+    Evaluator_destroy_workers(evs, workers);
+
+    memset(curve, 0, sizeof(Contours));
+    curve->offsets = calloc(1, sizeof(uint));
+    TraceBuffer points = { NULL, 0, 0 };
+    const Value low = -1;
+    const Value high = h + 1;
+    uint evaluations = 0;
+    int open = 0;
+    ContourPoint previous = { 0, NAN };
+
+    for (uint task = 0; task < tasks; task++) {
+        const TraceBuffer *buffer = &job.buffers[task];
+        // every task starts on the point the one before it ended on
+        for (uint i = task > 0; i < buffer->length; i++) {
+            const ContourPoint point = buffer->points[i];
+            if (!isfinite(point.y)) {
+                if (open) {
+                    curve->polyline_count++;
+                    open = 0;
+                }
+                previous = point;
+                continue;
+            }
+            if (isfinite(previous.y)) {
+                // the part of the segment from previous between low and high
+                Value t0 = 0;
+                Value t1 = 1;
+                const Value dy = point.y - previous.y;
+                if (dy != 0) {
+                    const Value tl = (low - previous.y) / dy;
+                    const Value th = (high - previous.y) / dy;
+                    t0 = fmax(t0, fmin(tl, th));
+                    t1 = fmin(t1, fmax(tl, th));
+                } else if (point.y < low || point.y > high) {
+                    t1 = -1;
+                }
+                if (t0 <= t1) {
+                    const ContourPoint c0 = { previous.x + (point.x - previous.x) * t0, previous.y + dy * t0 };
+                    const ContourPoint c1 = { previous.x + (point.x - previous.x) * t1, previous.y + dy * t1 };
+                    if (!open || t0 > 0) {
+                        if (open) {
+                            curve->polyline_count++;
+                        }
+                        plot_curve_append(curve, &points, c0, 0);
+                        open = 1;
+                    }
+                    plot_curve_append(curve, &points, c1, open);
+                    if (t1 < 1) {
+                        curve->polyline_count++;
+                        open = 0;
+                    }
+                }
+            }
+            previous = point;
+        }
+        evaluations += job.evaluations[task];
+        free(buffer->points);
+    }
+    if (open) {
+        curve->polyline_count++;
+    }
+    curve->offsets[curve->polyline_count] = points.length;
+    curve->polylines = points.points;
 
-    if (Value_fabs(r.value) > treshold) {
+    fprintf(stderr, "Function of %u polylines with %u points from %u samples\n", curve->polyline_count, points.length, evaluations);
+
+    free(job.buffers);
+    free(job.evaluations);
+    return 1;
+}
+
+
+// r is the value of the equation at (*xp, *yp)
+double refine_equation(Evaluator *ev, Value r, Value *xp, Value *yp, Value treshold, Value pixel_size, int depth) {
+    if (Value_fabs(r) > treshold) {
         return 0;
     }
     
@@ -80,70 +803,771 @@ double refine_equation(Expression equation, State *state, Value *xp, Value *yp,
         return 1;
     }
 
-    Value ox = *xp;
-    Value oy = *yp;
+    Value ox = *xp;
+    Value oy = *yp;
+
+    double alpha = 0.1;
+    const double alpha_per = (1.0 - alpha) * 0.25 * (1.0 + (double)depth);
+
+    *xp -= pixel_size * 0.25;
+    *yp -= pixel_size * 0.25;
+    alpha += alpha_per * refine_equation(ev, Evaluator_evaluate(ev), xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
+    *xp += pixel_size * 0.25;
+    alpha += alpha_per * refine_equation(ev, Evaluator_evaluate(ev), xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
+    *yp += pixel_size * 0.25;
+    alpha += alpha_per * refine_equation(ev, Evaluator_evaluate(ev), xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
+    *xp -= pixel_size * 0.25;
+    alpha += alpha_per * refine_equation(ev, Evaluator_evaluate(ev), xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
+
+    *xp = ox;
+    *yp = oy;
+
+    if (alpha > 1.0) {
+        alpha = 1.0;
+    }
+
+    return alpha;
+}
+
+// Cached values at the corners of the pixels of one tile and of their subdivisions, there are
+// 2^lattice_depth lattice cells per pixel side. Pixels share their edges when step is 1,
+// otherwise each pixel has its own stride + 1 points per side. A point is valid when its
+// stamp equals generation, which is bumped for every tile. Points missing from the cache are
+// queued and evaluated together in a batch
+typedef struct {
+    uint i;
+    uint j;
+} LatticeCell;
+
+typedef struct {
+    uint stride;
+    uint side;
+    uint generation;
+    uint *stamps;
+    Value *values;
+    uint c0;
+    uint r0;
+
+    uint queued;
+    uint *indices;
+    Value *xs;
+    Value *ys;
+    Value *results;
+
+    uint cell_capacity;
+    LatticeCell *cells;
+    LatticeCell *next;
+} Lattice;
+
+// Sample grid of plot_equation, column c and row r sample the pixel centered at (xs[c], ys[r]).
+// alpha only holds the rows [alpha_r0, alpha_r0 + alpha_rows) of the band being drawn
+typedef struct {
+    Evaluator *ev;
+    uint columns;
+    uint rows;
+    int step;
+    int halfw;
+    int halfh;
+    Value *xs;
+    Value *ys;
+    Value *values;
+    double *alpha;
+    uint alpha_r0;
+    uint alpha_rows;
+    Value treshold;
+    Value pixel_size;
+    unsigned long culled;
+    Lattice *lattice;
+    // with a tile cache tiles start at multiples of tile_size samples from the origin of the
+    // plane, origin_c and origin_r number column and row 0 from there
+    TileCache *cache;
+    long origin_c;
+    long origin_r;
+    uint shift_c;
+    uint shift_r;
+    unsigned long loaded;
+} EquationGrid;
+
+Lattice *Lattice_create(int step) {
+    Lattice *this = malloc(sizeof(Lattice));
+    const uint cells = 1u << lattice_depth;
+    this->stride = step == 1 ? cells : cells + 1;
+    this->side = tile_size * this->stride + 1;
+    this->generation = 0;
+
+    const uint points = this->side * this->side;
+    this->stamps = calloc(points, sizeof(uint));
+    this->values = malloc(sizeof(Value) * points);
+
+    // a point is queued at most once per tile
+    this->queued = 0;
+    this->indices = malloc(sizeof(uint) * points);
+    this->xs = malloc(sizeof(Value) * points * 3);
+    this->ys = this->xs + points;
+    this->results = this->ys + points;
+
+    this->cell_capacity = tile_size * tile_size;
+    this->cells = malloc(sizeof(LatticeCell) * this->cell_capacity);
+    this->next = malloc(sizeof(LatticeCell) * this->cell_capacity);
+    return this;
+}
+
+double *EquationGrid_alpha(EquationGrid *this, uint c, uint r) {
+    return &this->alpha[(size_t)c * this->alpha_rows + r - this->alpha_r0];
+}
+
+void Lattice_free(Lattice *this) {
+    free(this->stamps);
+    free(this->values);
+    free(this->indices);
+    free(this->xs);
+    free(this->cells);
+    free(this->next);
+    free(this);
+}
+
+// Coordinate of lattice point i along an axis, origin is the first pixel of the tile on that axis
+Value Lattice_coordinate(const EquationGrid *grid, uint origin, int half, Value center, uint i) {
+    const Lattice *this = grid->lattice;
+    const uint pixel = origin + i / this->stride;
+    const uint sub = i % this->stride;
+    return ((Value)((int)pixel * grid->step - half) + (Value)sub / (1u << lattice_depth)) * grid->pixel_size + center;
+}
+
+// Queues the point (i, j) unless its value is cached or already queued
+void Lattice_queue(EquationGrid *grid, uint i, uint j) {
+    Lattice *this = grid->lattice;
+    const uint index = j * this->side + i;
+    if (this->stamps[index] == this->generation) {
+        return;
+    }
+    this->stamps[index] = this->generation;
+    this->indices[this->queued] = index;
+    this->xs[this->queued] = Lattice_coordinate(grid, this->c0, grid->halfw, center_x, i);
+    this->ys[this->queued] = Lattice_coordinate(grid, this->r0, grid->halfh, center_y, j);
+    this->queued++;
+}
+
+void Lattice_flush(EquationGrid *grid) {
+    Lattice *this = grid->lattice;
+    Evaluator_evaluate_batch(grid->ev, this->xs, this->ys, this->results, this->queued);
+    for (uint k = 0; k < this->queued; k++) {
+        this->values[this->indices[k]] = this->results[k];
+    }
+    this->queued = 0;
+}
+
+void Lattice_queue_cell(EquationGrid *grid, LatticeCell cell, uint size) {
+    const uint half = size / 2;
+    Lattice_queue(grid, cell.i + half, cell.j);
+    Lattice_queue(grid, cell.i, cell.j + half);
+    Lattice_queue(grid, cell.i + half, cell.j + half);
+    Lattice_queue(grid, cell.i + size, cell.j + half);
+    Lattice_queue(grid, cell.i + half, cell.j + size);
+}
+
+// Whether the curve comes within treshold of a corner of the cell, or crosses the cell.
+// Crossings count only near zero so sign changes across poles are not drawn
+int Lattice_test(const EquationGrid *grid, LatticeCell cell, uint size, Value treshold) {
+    const Lattice *this = grid->lattice;
+    const Value *row = this->values + cell.j * this->side + cell.i;
+    const Value v[4] = { row[0], row[size], row[size * this->side], row[size * this->side + size] };
+
+    int negative = 0, positive = 0, near = 0, crossing = 0;
+    for (uint k = 0; k < 4; k++) {
+        negative |= v[k] < 0;
+        positive |= v[k] > 0;
+        near |= Value_fabs(v[k]) <= treshold;
+        crossing |= Value_fabs(v[k]) <= grid->treshold;
+    }
+    return (negative && positive && crossing) || near;
+}
+
+void Lattice_push(Lattice *this, uint *count, LatticeCell cell) {
+    if (*count == this->cell_capacity) {
+        this->cell_capacity *= 2;
+        this->cells = realloc(this->cells, sizeof(LatticeCell) * this->cell_capacity);
+        this->next = realloc(this->next, sizeof(LatticeCell) * this->cell_capacity);
+    }
+    this->next[(*count)++] = cell;
+}
+
+// Refines the pixels in columns [c0, c1) and rows [r0, r1) on the lattice one level at a time,
+// only cells that pass Lattice_test with treshold * treshold_multiplier^level are subdivided.
+// The alpha of a pixel is the share of its side that the curve runs through, measured in
+// finest lattice cells
+void EquationGrid_sample_lattice(EquationGrid *this, uint c0, uint c1, uint r0, uint r1) {
+    Lattice *lattice = this->lattice;
+    const uint cells = 1u << lattice_depth;
+    const uint stride = lattice->stride;
+
+    uint count = 0;
+    for (uint c = c0; c < c1; c++) {
+        for (uint r = r0; r < r1; r++) {
+            LatticeCell cell = { (c - lattice->c0) * stride, (r - lattice->r0) * stride };
+            Lattice_queue(this, cell.i, cell.j);
+            Lattice_queue(this, cell.i + cells, cell.j);
+            Lattice_queue(this, cell.i, cell.j + cells);
+            Lattice_queue(this, cell.i + cells, cell.j + cells);
+            Lattice_push(lattice, &count, cell);
+        }
+    }
+    Lattice_flush(this);
+
+    Value treshold = this->treshold;
+    uint size = cells;
+    uint active = 0;
+    for (uint k = 0; k < count; k++) {
+        if (Lattice_test(this, lattice->next[k], size, treshold)) {
+            lattice->cells[active++] = lattice->next[k];
+        }
+    }
+
+    while (size > 1 && active > 0) {
+        for (uint k = 0; k < active; k++) {
+            Lattice_queue_cell(this, lattice->cells[k], size);
+        }
+        Lattice_flush(this);
+
+        const uint half = size / 2;
+        treshold *= treshold_multiplier;
+        count = 0;
+        for (uint k = 0; k < active; k++) {
+            const LatticeCell cell = lattice->cells[k];
+            const LatticeCell children[4] = {
+                { cell.i, cell.j }, { cell.i + half, cell.j },
+                { cell.i, cell.j + half }, { cell.i + half, cell.j + half }
+            };
+            for (uint l = 0; l < 4; l++) {
+                if (Lattice_test(this, children[l], half, treshold)) {
+                    Lattice_push(lattice, &count, children[l]);
+                }
+            }
+        }
+
+        LatticeCell *swap = lattice->cells;
+        lattice->cells = lattice->next;
+        lattice->next = swap;
+        active = count;
+        size = half;
+    }
+
+    // the remaining cells are of the finest size, each one adds to the alpha of its pixel
+    for (uint k = 0; k < active; k++) {
+        const uint c = lattice->c0 + lattice->cells[k].i / stride;
+        const uint r = lattice->r0 + lattice->cells[k].j / stride;
+        *EquationGrid_alpha(this, c, r) += 1.0 / cells;
+    }
+    for (uint c = c0; c < c1; c++) {
+        for (uint r = r0; r < r1; r++) {
+            double *alpha = EquationGrid_alpha(this, c, r);
+            if (*alpha > 1.0) {
+                *alpha = 1.0;
+            }
+        }
+    }
+}
+
+// Covers the pixels in columns [c0, c1) and rows [r0, r1) by their distance to the curve,
+// |f| / |grad f| in pixels. Pixels are fully covered within half a line width and fade out
+// over the next pixel
+void EquationGrid_sample_distance(EquationGrid *this, uint c0, uint c1, uint r0, uint r1) {
+    Evaluator *ev = this->ev;
+    for (uint c = c0; c < c1; c++) {
+        *ev->xp = this->xs[c];
+        for (uint r = r0; r < r1; r++) {
+            *ev->yp = this->ys[r];
+            const Dual f = Evaluator_evaluate_dual(ev, this->pixel_size * 0.5);
+            const Value gradient = sqrt(f.dx * f.dx + f.dy * f.dy);
+            const Value distance = f.v == 0 ? 0 : Value_fabs(f.v) / (gradient * this->pixel_size);
+            const Value coverage = line_width * 0.5 + 0.5 - distance;
+            if (coverage > 0) {
+                *EquationGrid_alpha(this, c, r) = coverage < 1 ? coverage : 1;
+            }
+        }
+    }
+}
+
+// Evaluates the samples in columns [c0, c1) and rows [r0, r1)
+void EquationGrid_sample(EquationGrid *this, uint c0, uint c1, uint r0, uint r1) {
+    if (this->lattice) {
+        EquationGrid_sample_lattice(this, c0, c1, r0, r1);
+        return;
+    }
+    if (refinement == REFINEMENT_DISTANCE) {
+        EquationGrid_sample_distance(this, c0, c1, r0, r1);
+        return;
+    }
+
+    Evaluator *ev = this->ev;
+    for (uint c = c0; c < c1; c++) {
+        *ev->xp = this->xs[c];
+        Evaluator_evaluate_batch(ev, NULL, this->ys + r0, this->values, r1 - r0);
+        for (uint r = r0; r < r1; r++) {
+            const Value value = this->values[r - r0];
+            if (Value_fabs(value) > this->treshold) {
+                continue;
+            }
+            *ev->yp = this->ys[r];
+            *EquationGrid_alpha(this, c, r) = refine_equation(ev, value, ev->xp, ev->yp, this->treshold, this->pixel_size, 0);
+        }
+    }
+}
+
+// Drops rectangles of pixels where the equation cannot come within treshold of zero,
+// subdividing down to blocks of cull_block samples per side which are sampled.
+// Distance refinement isn't culled, its linear estimate covers pixels near minima of |f|
+// where f has no zero at all
+void EquationGrid_cull(EquationGrid *this, uint c0, uint c1, uint r0, uint r1) {
+    const Value half = this->pixel_size * 0.5;
+    Interval x = { this->xs[c0] - half, this->xs[c1 - 1] + half };
+    Interval y = { this->ys[r0] - half, this->ys[r1 - 1] + half };
+    Interval range = Evaluator_evaluate_interval(this->ev, x, y);
+    if (range.lo > this->treshold || range.hi < -this->treshold) {
+        this->culled += (unsigned long)(c1 - c0) * (r1 - r0);
+        return;
+    }
+
+    const uint cw = c1 - c0;
+    const uint rh = r1 - r0;
+    if (cw <= (uint)cull_block && rh <= (uint)cull_block) {
+        EquationGrid_sample(this, c0, c1, r0, r1);
+        return;
+    }
+
+    const uint cm = cw > 1 ? c0 + cw / 2 : c1;
+    const uint rm = rh > 1 ? r0 + rh / 2 : r1;
+    EquationGrid_cull(this, c0, cm, r0, rm);
+    if (rm < r1) {
+        EquationGrid_cull(this, c0, cm, rm, r1);
+    }
+    if (cm < c1) {
+        EquationGrid_cull(this, cm, c1, r0, rm);
+        if (rm < r1) {
+            EquationGrid_cull(this, cm, c1, rm, r1);
+        }
+    }
+}
+
+// Renders the tile of tile_size samples per side numbered task counting from the tiles at
+// alpha_r0, context holds a grid for every worker
+void EquationGrid_run_tile(void *vgrids, uint worker, uint task) {
+    EquationGrid *this = &((EquationGrid*)vgrids)[worker];
+    const uint tiles = (this->columns + this->shift_c + tile_size - 1) / tile_size;
+    const uint tc = task % tiles;
+    const uint tr = (this->alpha_r0 + this->shift_r) / tile_size + task / tiles;
+    const uint c0 = tc * tile_size > this->shift_c ? tc * tile_size - this->shift_c : 0;
+    const uint r0 = tr * tile_size > this->shift_r ? tr * tile_size - this->shift_r : 0;
+    const uint c1 = (tc + 1) * tile_size - this->shift_c < this->columns ? (tc + 1) * tile_size - this->shift_c : this->columns;
+    const uint r1 = (tr + 1) * tile_size - this->shift_r < this->rows ? (tr + 1) * tile_size - this->shift_r : this->rows;
+
+    char *key = NULL;
+    if (this->cache) {
+        key = TileCache_key(this->cache, this->origin_c + c0, this->origin_c + c1, this->origin_r + r0, this->origin_r + r1);
+        if (TileCache_load(this->cache, key, EquationGrid_alpha(this, c0, r0), c1 - c0, r1 - r0, this->alpha_rows)) {
+            this->loaded++;
+            free(key);
+            return;
+        }
+    }
+
+    if (this->lattice) {
+        this->lattice->generation++;
+        this->lattice->c0 = c0;
+        this->lattice->r0 = r0;
+    }
+
+    if (cull_block > 0 && refinement != REFINEMENT_DISTANCE) {
+        EquationGrid_cull(this, c0, c1, r0, r1);
+    } else {
+        EquationGrid_sample(this, c0, c1, r0, r1);
+    }
+
+    if (key) {
+        TileCache_store(this->cache, key, EquationGrid_alpha(this, c0, r0), c1 - c0, r1 - r0, this->alpha_rows, worker);
+        free(key);
+    }
+}
+
+// Sets up the tile cache of grid, keyed by everything the coverage of a tile depends on.
+// Samples are numbered from the origin of the plane, so viewports that are panned by whole
+// samples share their tiles
+void EquationGrid_cache(EquationGrid *grid, Evaluator *ev, Value scale) {
+    const char *directory = cache_path();
+    if (directory == NULL) {
+        fprintf(stderr, "No cache directory, rendering without the tile cache\n");
+        return;
+    }
+
+    // column c samples the pixel c * step + offset_x from the origin, split into a whole number
+    // of samples and a remainder that has to match for tiles to line up
+    const Value offset_x = center_x * scale - grid->halfw;
+    const Value offset_y = center_y * scale - grid->halfh;
+    grid->origin_c = (long)floor(offset_x / grid->step);
+    grid->origin_r = (long)floor(offset_y / grid->step);
+    const Value fraction_x = offset_x - (Value)grid->origin_c * grid->step;
+    const Value fraction_y = offset_y - (Value)grid->origin_r * grid->step;
+    grid->shift_c = (uint)(((grid->origin_c % tile_size) + tile_size) % tile_size);
+    grid->shift_r = (uint)(((grid->origin_r % tile_size) + tile_size) % tile_size);
+
+    char *canonical = canonicalExpression(ev->expression, &ev->state);
+    char *prefix = malloc(strlen(canonical) + 512);
+    sprintf(prefix, "E %d %s %d %d %d %.17g %.17g %.17g %d %d %.17g %.17g %.17g %c %.17g\n%s",
+        ev->backend, Vector_kernels()->name, refinement, lattice_depth, max_depth,
+        grid->treshold, treshold_multiplier, line_width, cull_block, grid->step,
+        scale, fraction_x, fraction_y, sweep_frames > 0 ? sweep_variable : '-', sweep_value, canonical);
+    free(canonical);
+    grid->cache = TileCache_create(directory, prefix);
+    if (grid->cache == NULL) {
+        fprintf(stderr, "Failed to create the tile directory, rendering without the tile cache\n");
+    }
+}
+
+// Sets up the sample grids of the workers for plot_equation_band, returns NULL on failure
+EquationGrid *plot_equation_prepare(Expression equation, Value treshold, int w, int h, Value scale, int step, uint *workers) {
+    const int halfw = w / 2;
+    const int halfh = h / 2;
+
+    const Value scale_inv = 1 / scale;
+
+    EquationGrid grid;
+    grid.columns = (w + step - 1) / step;
+    grid.rows = (h + step - 1) / step;
+    grid.treshold = treshold;
+    grid.pixel_size = scale_inv;
+    grid.culled = 0;
+    grid.step = step;
+    grid.halfw = halfw;
+    grid.halfh = halfh;
+    grid.alpha = NULL;
+    grid.lattice = NULL;
+    grid.cache = NULL;
+    grid.origin_c = 0;
+    grid.origin_r = 0;
+    grid.shift_c = 0;
+    grid.shift_r = 0;
+    grid.loaded = 0;
+
+    const unsigned long tasks = (unsigned long)((grid.columns + tile_size - 1) / tile_size) * ((grid.rows + tile_size - 1) / tile_size);
+    *workers = plot_threads();
+    if (*workers > tasks) {
+        *workers = tasks;
+    }
+
+    Evaluator *evs = Evaluator_create_workers(equation, backend, *workers);
+    if (evs == NULL) {
+        return NULL;
+    }
+
+    if (tile_cache) {
+        EquationGrid_cache(&grid, &evs[0], scale);
+    }
+
+    grid.xs = malloc(sizeof(Value) * (grid.columns + grid.rows * (1 + *workers)));
+    grid.ys = grid.xs + grid.columns;
+
+    for (uint i = 0; i < grid.columns; i++) {
+        grid.xs[i] = ((Value)((int)i * step - halfw) + 0.5) * scale_inv + center_x;
+    }
+    for (uint i = 0; i < grid.rows; i++) {
+        grid.ys[i] = ((Value)((int)i * step - halfh) + 0.5) * scale_inv + center_y;
+    }
+
+    // workers share the sample grid and write disjoint tiles of alpha
+    EquationGrid *grids = malloc(sizeof(EquationGrid) * *workers);
+    for (uint i = 0; i < *workers; i++) {
+        grids[i] = grid;
+        grids[i].ev = &evs[i];
+        grids[i].values = grid.ys + grid.rows * (1 + i);
+        if (refinement == REFINEMENT_LATTICE) {
+            grids[i].lattice = Lattice_create(step);
+        }
+    }
+    return grids;
+}
+
+// Renders the rows of tiles holding samples whose dots reach into band
+void plot_equation_band(EquationGrid *grids, uint workers, BMP_color color, Band *band, int step, int size) {
+    EquationGrid *grid = &grids[0];
+
+    // a dot at y covers [y - size / 2, y - size / 2 + size)
+    const int first = band->y0 + size / 2 - size + 1;
+    const int last = band->y0 + band->rows + size / 2;
+    const uint r0 = first > 0 ? (first + step - 1) / step : 0;
+    uint r1 = last > 0 ? (last + step - 1) / step : 0;
+    if (r1 > grid->rows) {
+        r1 = grid->rows;
+    }
+    if (r0 >= r1) {
+        return;
+    }
+
+    const uint t0 = (r0 + grid->shift_r) / tile_size;
+    const uint t1 = (r1 + grid->shift_r + tile_size - 1) / tile_size;
+    const uint alpha_r0 = t0 * tile_size > grid->shift_r ? t0 * tile_size - grid->shift_r : 0;
+    const uint alpha_r1 = t1 * tile_size - grid->shift_r < grid->rows ? t1 * tile_size - grid->shift_r : grid->rows;
+    double *alpha = calloc((size_t)grid->columns * (alpha_r1 - alpha_r0), sizeof(double));
+    for (uint i = 0; i < workers; i++) {
+        grids[i].alpha = alpha;
+        grids[i].alpha_r0 = alpha_r0;
+        grids[i].alpha_rows = alpha_r1 - alpha_r0;
+    }
+
+    const uint tiles = (grid->columns + grid->shift_c + tile_size - 1) / tile_size;
+    WorkPool_run(workers, tiles * (t1 - t0), EquationGrid_run_tile, grids);
+
+    // dots are blended in column order so overlapping ones combine the same way regardless of culling
+    for (uint c = 0; c < grid->columns; c++) {
+        for (uint r = r0; r < r1; r++) {
+            const double a = *EquationGrid_alpha(grid, c, r);
+            if (a == 0) {
+                continue;
+            }
+            render_dot(size, color, a, band, c * step, r * step);
+        }
+    }
+
+    free(alpha);
+}
+
+void plot_equation_free(EquationGrid *grids, uint workers) {
+    if (cull_block > 0 && refinement != REFINEMENT_DISTANCE) {
+        unsigned long culled = 0;
+        for (uint i = 0; i < workers; i++) {
+            culled += grids[i].culled;
+        }
+        fprintf(stderr, "Interval culling skipped %lu of %lu samples\n", culled, (unsigned long)grids[0].columns * grids[0].rows);
+    }
+    if (grids[0].cache) {
+        unsigned long loaded = 0;
+        for (uint i = 0; i < workers; i++) {
+            loaded += grids[i].loaded;
+        }
+        fprintf(stderr, "Tile cache: %lu tiles loaded\n", loaded);
+        TileCache_free(grids[0].cache);
+    }
+
+    Evaluator *evs = grids[0].ev;
+    free(grids[0].xs);
+    for (uint i = 0; i < workers; i++) {
+        if (grids[i].lattice) {
+            Lattice_free(grids[i].lattice);
+        }
+    }
+    free(grids);
+    Evaluator_destroy_workers(evs, workers);
+}
+
+
+typedef struct {
+    Evaluator *evs;
+    const Value *xs;
+    const Value *ys;
+    uint rows;
+    Value *values;
+} GridJob;
+
+// Evaluates column task of the grid
+void GridJob_run(void *vthis, uint worker, uint task) {
+    GridJob *this = vthis;
+    Evaluator *ev = &this->evs[worker];
+    *ev->xp = this->xs[task];
+    Evaluator_evaluate_batch(ev, NULL, this->ys, this->values + task * this->rows, this->rows);
+}
+
+// Grid of contour_cells square-ish cells across a w by h image in pixel space
+ContourGrid contour_grid(int w, int h) {
+    ContourGrid grid;
+    grid.columns = contour_cells > 0 ? contour_cells : 1;
+    grid.rows = (uint)((long)grid.columns * h / w);
+    if (grid.rows == 0) {
+        grid.rows = 1;
+    }
+    grid.x0 = 0;
+    grid.y0 = 0;
+    grid.dx = (Value)w / grid.columns;
+    grid.dy = (Value)h / grid.rows;
+    grid.values = NULL;
+    return grid;
+}
+
+// Evaluates the equation at the corners of grid with the workers into grid->values
+void plot_contour_sample(Evaluator *evs, uint workers, ContourGrid *grid, int w, int h, Value scale) {
+    const int halfw = w / 2;
+    const int halfh = h / 2;
+    const Value scale_inv = 1 / scale;
+
+    Value *xs = malloc(sizeof(Value) * (grid->columns + grid->rows + 2));
+    Value *ys = xs + grid->columns + 1;
+    grid->values = malloc(sizeof(Value) * (grid->columns + 1) * (grid->rows + 1));
+
+    for (uint i = 0; i <= grid->columns; i++) {
+        xs[i] = (grid->x0 + i * grid->dx - halfw) * scale_inv + center_x;
+    }
+    for (uint j = 0; j <= grid->rows; j++) {
+        ys[j] = (grid->y0 + j * grid->dy - halfh) * scale_inv + center_y;
+    }
+
+    GridJob job = { evs, xs, ys, grid->rows + 1, grid->values };
+    WorkPool_run(workers, grid->columns + 1, GridJob_run, &job);
+    free(xs);
+}
+
+// Rejects the crossings of contours that aren't zeros. A sign change is only a zero crossing if
+// the function gets closer to zero at the interpolated point, otherwise it is a pole or a
+// discontinuity
+void plot_contour_reject(Evaluator *ev, Contours *contours, Value treshold, int w, int h, Value scale) {
+    const int halfw = w / 2;
+    const int halfh = h / 2;
+    const Value scale_inv = 1 / scale;
+
+    Value *pxs = malloc(sizeof(Value) * contours->point_count * 3 + 1);
+    Value *pys = pxs + contours->point_count;
+    Value *pvalues = pys + contours->point_count;
+    for (uint k = 0; k < contours->point_count; k++) {
+        pxs[k] = (contours->points[k].x - halfw) * scale_inv + center_x;
+        pys[k] = (contours->points[k].y - halfh) * scale_inv + center_y;
+    }
+    Evaluator_evaluate_batch(ev, pxs, pys, pvalues, contours->point_count);
+    for (uint k = 0; k < contours->point_count; k++) {
+        if (!(Value_fabs(pvalues[k]) <= treshold || Value_fabs(pvalues[k]) < Contours_edge_distance(contours, k))) {
+            Contours_reject(contours, k);
+        }
+    }
+    free(pxs);
+}
+
+// Samples the equation on a grid of contour_cells cells across the image and extracts its zero
+// contours in pixel space with marching squares, returns 0 on failure
+int plot_contour_prepare(Expression equation, Value treshold, Contours *contours, int w, int h, Value scale) {
+    ContourGrid grid = contour_grid(w, h);
+
+    uint workers = plot_threads();
+    if (workers > grid.columns + 1) {
+        workers = grid.columns + 1;
+    }
+
+    Evaluator *evs = Evaluator_create_workers(equation, backend, workers);
+    if (evs == NULL) {
+        return 0;
+    }
+
+    plot_contour_sample(evs, workers, &grid, w, h, scale);
+    Contours_init(contours, grid);
+    plot_contour_reject(&evs[0], contours, treshold, w, h, scale);
+    Contours_trace(contours);
+    fprintf(stderr, "Contour of %u polylines with %u points from %u samples\n",
+        contours->polyline_count, contours->offsets[contours->polyline_count], (grid.columns + 1) * (grid.rows + 1));
 
-    double alpha = 0.1;
-    const double alpha_per = (1.0 - alpha) * 0.25 * (1.0 + (double)depth);
+    free(grid.values);
+    contours->grid.values = NULL;
+    Evaluator_destroy_workers(evs, workers);
+    return 1;
+}
 
-    *xp -= pixel_size * 0.25;
-    *yp -= pixel_size * 0.25;
-    alpha += alpha_per * refine_equation(equation, state, xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
-    *xp += pixel_size * 0.25;
-    alpha += alpha_per * refine_equation(equation, state, xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
-    *yp += pixel_size * 0.25;
-    alpha += alpha_per * refine_equation(equation, state, xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
-    *xp -= pixel_size * 0.25;
-    alpha += alpha_per * refine_equation(equation, state, xp, yp, treshold * treshold_multiplier, pixel_size * 0.5, depth + 1);
+// Maps the pixel space of the tracer onto the plane of an evaluator
+typedef struct {
+    Evaluator *ev;
+    Value halfw;
+    Value halfh;
+    Value scale_inv;
+} TraceContext;
 
-    *xp = ox;
-    *yp = oy;
+Dual TraceContext_evaluate(void *vthis, Value x, Value y) {
+    TraceContext *this = vthis;
+    *this->ev->xp = (x - this->halfw) * this->scale_inv + center_x;
+    *this->ev->yp = (y - this->halfh) * this->scale_inv + center_y;
+    Dual f = Evaluator_evaluate_dual(this->ev, this->scale_inv * 0.5);
+    f.dx *= this->scale_inv;
+    f.dy *= this->scale_inv;
+    return f;
+}
 
-    if (alpha > 1.0) {
-        alpha = 1.0;
+// Follows the zero set of the equation from the crossings of a coarse contour_cells grid, so
+// past the grid the evaluations grow with the length of the curves instead of the area of the
+// image. Returns 0 on failure
+int plot_trace_prepare(Expression equation, Value treshold, Contours *contours, int w, int h, Value scale) {
+    ContourGrid grid = contour_grid(w, h);
+
+    uint workers = plot_threads();
+    if (workers > grid.columns + 1) {
+        workers = grid.columns + 1;
     }
 
-    return alpha;
-}
+    Evaluator *evs = Evaluator_create_workers(equation, backend, workers);
+    if (evs == NULL) {
+        return 0;
+    }
 
-void plot_equation(Expression equation, Value treshold, BMP_color color, BMP_color *framebuffer, int w, int h, Value scale, int step, int size) {
-    const int halfw = w / 2;
-    const int halfh = h / 2;
-    
-    State state;
-    State_init(&state);
-    state.vars['x'].occupied = 1;
-    state.vars['y'].occupied = 1;
+    Contours seeds;
+    plot_contour_sample(evs, workers, &grid, w, h, scale);
+    Contours_init(&seeds, grid);
+    plot_contour_reject(&evs[0], &seeds, treshold, w, h, scale);
 
-    Value *xp = &state.vars['x'].value;
-    Value *yp = &state.vars['y'].value;
+    TraceContext context = { &evs[0], w / 2, h / 2, 1 / scale };
+    Tracer tracer;
+    Tracer_init(&tracer, TraceContext_evaluate, &context, w, h);
+    const Value limit = grid.dx > grid.dy ? grid.dx : grid.dy;
+    uint seed_count = 0;
+    for (uint k = 0; k < seeds.point_count; k++) {
+        if (Contours_accepted(&seeds, k)) {
+            Tracer_trace(&tracer, seeds.points[k], limit);
+            seed_count++;
+        }
+    }
+    Tracer_finish(&tracer, contours);
 
-    *xp = 0;
-    *yp = 0;
+    fprintf(stderr, "Traced %u polylines with %u points from %u seeds and %lu evaluations\n",
+        contours->polyline_count, contours->offsets[contours->polyline_count], seed_count,
+        tracer.evaluations + seeds.point_count + (unsigned long)(grid.columns + 1) * (grid.rows + 1));
 
-    Result r = Expression_evaluate(equation, &state);
-    if (r.error) {
-        fprintf(stderr, "Evaluation error: %s\n", r.error);
-        free(r.error);
-        return;
-    }
+    free(grid.values);
+    Contours_destroy(&seeds);
+    Evaluator_destroy_workers(evs, workers);
+    return 1;
+}
 
-    const Value scale_inv = 1 / scale;
+// Draws the contours as anti-aliased lines, alpha is gathered for the rows dots into band
+// can come from
+void plot_contour_band(const Contours *contours, BMP_color color, Band *band, int size) {
+    const int w = band->w;
+    const int ay0 = band->y0 - size > 0 ? band->y0 - size : 0;
+    const int ay1 = band->y0 + band->rows + size < band->h ? band->y0 + band->rows + size : band->h;
+    double *alpha = calloc((size_t)w * (ay1 - ay0), sizeof(double));
 
-    for (int x = 0; x < w; x += step) {
-        *xp = ((Value)(x - halfw) + 0.5) * scale_inv;
-        for (int y = 0; y < h; y += step) {
-            *yp = ((Value)(y - halfh) + 0.5) * scale_inv;
-            double alpha = refine_equation(equation, &state, xp, yp, treshold, scale_inv, 0);
-            if (alpha == 0) {
+    for (uint k = 0; k < contours->polyline_count; k++) {
+        for (uint p = contours->offsets[k] + 1; p < contours->offsets[k + 1]; p++) {
+            const ContourPoint a = contours->polylines[p - 1];
+            const ContourPoint b = contours->polylines[p];
+            if ((a.y < ay0 - 1 && b.y < ay0 - 1) || (a.y > ay1 + 1 && b.y > ay1 + 1)) {
                 continue;
             }
+            render_line(alpha, w, ay0, ay1 - ay0, a.x, a.y, b.x, b.y);
+        }
+    }
+    for (int x = 0; x < w; x++) {
+        for (int y = ay0; y < ay1; y++) {
+            const double a = alpha[(size_t)(y - ay0) * w + x];
+            if (a > 0) {
+                render_dot(size, color, a, band, x, y);
+            }
+        }
+    }
+    free(alpha);
+}
 
-            render_dot(size, color, alpha, framebuffer, w, h, x, y);
+void plot_contour_svg(const Contours *contours, BMP_color color, FILE *svg, int h) {
+    for (uint k = 0; k < contours->polyline_count; k++) {
+        SVG_polyline_begin(svg, SVG_COLOR(color));
+        for (uint p = contours->offsets[k]; p < contours->offsets[k + 1]; p++) {
+            SVG_point(svg, contours->polylines[p].x, h - contours->polylines[p].y);
         }
+        SVG_polyline_end(svg);
     }
 }
 
+// timing loops store their results here so the compiler keeps the calls
+volatile Value benchmark_sink;
 
 void benchmark_expression(Expression expression, int w, int h) {
     State state;
@@ -176,17 +1600,25 @@ void benchmark_expression(Expression expression, int w, int h) {
 
 
     {
-        CompilationContext ctx = { &state };
-        CompilationResult cr = Expression_compile(expression, ctx);
+        Arena arena;
+        Arena_init(&arena);
+        CompilationContext ctx = { &state, &arena };
+        CompilationResult cr = compileExpression(expression, ctx);
         if (cr.error) {
             fprintf(stderr, "Error: %s\n", cr.error);
             free(cr.error);
+            Arena_free(&arena);
             return;
         }
 
         Program *prog = Program_create(cr);
-        Value *xp = prog->reg.slots['x'].value;
-        Value *yp = prog->reg.slots['y'].value;
+        Arena_free(&arena);
+        ProgramContext *context = ProgramContext_create(prog);
+        Value unused;
+        Value *xp = ProgramContext_variable(context, prog, 'x');
+        Value *yp = ProgramContext_variable(context, prog, 'y');
+        xp = xp ? xp : &unused;
+        yp = yp ? yp : &unused;
 
         clock_t c_begin = clock();
 
@@ -194,13 +1626,127 @@ void benchmark_expression(Expression expression, int w, int h) {
             *xp = (double)x;
             for (int y = 0; y < h; y++) {
                 *yp = (double)y;
-                Value r = Program_execute(prog);
+                Value r = Program_execute(prog, context);
             }
         }
 
         clock_t c_end = clock();
 
         fprintf(stderr, "Clocks taken for %d executions of compiled expression: %ld\n", w * h, c_end - c_begin);
+
+        const Value *inputs[MATH_MAX_VARS] = { NULL };
+        Value *ys = malloc(sizeof(Value) * h * 2);
+        Value *out = ys + h;
+        for (int y = 0; y < h; y++) {
+            ys[y] = (double)y;
+        }
+        inputs['y'] = ys;
+
+        c_begin = clock();
+
+        for (int x = 0; x < w; x++) {
+            *xp = (double)x;
+            Program_execute_batch(prog, context, inputs, out, h);
+        }
+
+        c_end = clock();
+
+        fprintf(stderr, "Clocks taken for %d executions of compiled expression in batches (%s kernels): %ld\n", w * h, prog->kernels->name, c_end - c_begin);
+
+        char *error = Program_jit(prog);
+        if (error) {
+            fprintf(stderr, "%s\n", error);
+            free(error);
+        } else {
+            Value sum = 0;
+            c_begin = clock();
+
+            for (int x = 0; x < w; x++) {
+                *xp = (double)x;
+                for (int y = 0; y < h; y++) {
+                    *yp = (double)y;
+                    sum += Program_execute(prog, context);
+                }
+            }
+
+            c_end = clock();
+            benchmark_sink = sum;
+
+            fprintf(stderr, "Clocks taken for %d executions of native code (%u bytes): %ld\n", w * h, prog->native_size, c_end - c_begin);
+        }
+
+        free(ys);
+        ProgramContext_free(context);
+        Program_free(prog);
+    }
+
+    {
+        Arena arena;
+        Arena_init(&arena);
+        CompilationContext ctx = { &state, &arena };
+        Program *prog = Program_create(compileExpression(expression, ctx));
+        Arena_free(&arena);
+
+        const char *directory = cache_path();
+        char *canonical = canonicalExpression(expression, &state);
+        clock_t c_begin = clock();
+        char *error = directory ? Program_cc(prog, canonical, directory) : NULL;
+        clock_t c_end = clock();
+        free(canonical);
+
+        if (directory == NULL || error) {
+            fprintf(stderr, "%s\n", error ? error : "No cache directory");
+            free(error);
+            Program_free(prog);
+            return;
+        }
+        fprintf(stderr, "Clocks taken to build or load the expression with " MATH_CC ": %ld\n", c_end - c_begin);
+
+        ProgramContext *context = ProgramContext_create(prog);
+        Value unused;
+        Value *xp = ProgramContext_variable(context, prog, 'x');
+        Value *yp = ProgramContext_variable(context, prog, 'y');
+        xp = xp ? xp : &unused;
+        yp = yp ? yp : &unused;
+
+        Value sum = 0;
+        c_begin = clock();
+
+        for (int x = 0; x < w; x++) {
+            *xp = (double)x;
+            for (int y = 0; y < h; y++) {
+                *yp = (double)y;
+                sum += Program_execute(prog, context);
+            }
+        }
+
+        c_end = clock();
+        benchmark_sink = sum;
+
+        fprintf(stderr, "Clocks taken for %d executions of code compiled by " MATH_CC ": %ld\n", w * h, c_end - c_begin);
+
+        const Value *inputs[MATH_MAX_VARS] = { NULL };
+        Value *ys = malloc(sizeof(Value) * h * 2);
+        Value *out = ys + h;
+        for (int y = 0; y < h; y++) {
+            ys[y] = (double)y;
+        }
+        inputs['y'] = ys;
+
+        c_begin = clock();
+
+        for (int x = 0; x < w; x++) {
+            *xp = (double)x;
+            Program_execute_batch(prog, context, inputs, out, h);
+        }
+
+        c_end = clock();
+
+        fprintf(stderr, "Clocks taken for %d executions of code compiled by " MATH_CC " in batches: %ld\n", w * h, c_end - c_begin);
+
+        free(ys);
+        ProgramContext_free(context);
+        Program_free(prog);
     }
 
 }
@@ -213,76 +1759,430 @@ const BMP_color colors[] = {
 
 
 enum PlotType {
-    FUNCTION, EQUATION, BENCHMARK
+    FUNCTION, EQUATION, CONTOUR, TRACE, BENCHMARK
 };
 
-void plot_expression(enum PlotType type, const char *source, BMP_color *fb, int w, int h) {
-    static int color_index = 0;
-    char in[512];
-    strcpy(in, source);
+// A parsed expression with whatever it keeps between the bands it is drawn into
+typedef struct {
+    enum PlotType type;
+    // owns the expression
+    Arena arena;
+    Expression expression;
+    BMP_color color;
+    // function values at every step'th column, NULL if the function was sampled adaptively
+    // into contours
+    Value *ys;
+    // sample grids of the workers of an equation
+    uint workers;
+    EquationGrid *grids;
+    Contours contours;
+} Plot;
+
+// Index into colors of the next plot, every image starts from the first color
+int color_index = 0;
+
+// Parses and prepares source, benchmarks are run right away. Returns 0 if there is nothing to draw
+int Plot_init(Plot *this, enum PlotType type, const char *source, int w, int h) {
+    char *in = strdup(source);
     char *cursor = in;
-    ParserResult result = parseExpression(&cursor);
+    Arena_init(&this->arena);
+    ParserResult result = parseExpression(&cursor, &this->arena);
+    free(in);
     if (result.error) {
         fprintf(stderr, "Parser error: %s\n", result.error);
         free(result.error);
-        return;
+        Arena_free(&this->arena);
+        return 0;
     }
     fprintf(stderr, "Expression: ");
     Expression_print(result.expression, stderr);
     fprintf(stderr, "\n");
 
+    this->type = type;
+    this->expression = result.expression;
+    this->color = colors[color_index];
+    color_index = (color_index + 1) % ARRLEN(colors);
+
+    int ready = 0;
     switch (type) {
         case FUNCTION:
-            plot_function(result.expression, colors[color_index], fb, w, h, scale, step, size);
+            this->ys = NULL;
+            if (sampling == SAMPLING_ADAPTIVE) {
+                ready = plot_function_adapt(this->expression, &this->contours, w, h, scale);
+                break;
+            }
+            this->ys = plot_function_sample(this->expression, w, scale, step);
+            ready = this->ys != NULL;
             break;
         case EQUATION:
-            plot_equation(result.expression, treshold, colors[color_index], fb, w, h, scale, step, size);
+            this->grids = plot_equation_prepare(this->expression, treshold, w, h, scale, step, &this->workers);
+            ready = this->grids != NULL;
+            break;
+        case CONTOUR:
+            ready = plot_contour_prepare(this->expression, treshold, &this->contours, w, h, scale);
+            break;
+        case TRACE:
+            ready = plot_trace_prepare(this->expression, treshold, &this->contours, w, h, scale);
             break;
         case BENCHMARK:
-            benchmark_expression(result.expression, w * 4, h * 4);
+            benchmark_expression(this->expression, w * 4, h * 4);
     }
 
-    color_index = (color_index + 1) % ARRLEN(colors);
-
-    Expression_destroy(result.expression);
-    Expression_free(result.expression);
+    if (!ready) {
+        Arena_free(&this->arena);
+    }
+    return ready;
 }
 
-int main(int argc, const char **argv) {
-    int code = 0;
+void Plot_band(Plot *this, Band *band) {
+    switch (this->type) {
+        case FUNCTION:
+            if (this->ys == NULL) {
+                plot_contour_band(&this->contours, this->color, band, size);
+                break;
+            }
+            plot_function_band(this->ys, this->color, band, scale, step, size);
+            break;
+        case EQUATION:
+            plot_equation_band(this->grids, this->workers, this->color, band, step, size);
+            break;
+        case CONTOUR:
+        case TRACE:
+            plot_contour_band(&this->contours, this->color, band, size);
+            break;
+        default:
+    }
+}
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s (output file) [F=/E=/B=](math expression)...\n", argv[0]);
-        return 1;
+// Equations are drawn as contours in svg
+void Plot_svg(Plot *this, FILE *svg, int w, int h) {
+    switch (this->type) {
+        case FUNCTION:
+            if (this->ys == NULL) {
+                plot_contour_svg(&this->contours, this->color, svg, h);
+                break;
+            }
+            plot_function_svg(this->ys, this->color, svg, w, h, scale, step);
+            break;
+        case CONTOUR:
+        case TRACE:
+            plot_contour_svg(&this->contours, this->color, svg, h);
+            break;
+        default:
     }
-    
-    FILE *out = fopen(argv[1], "wb");
-    if (out == NULL) {
-        fprintf(stderr, "Failed to open file for writing\n");
-        code = 1;
-        goto cleanup;
+}
+
+void Plot_destroy(Plot *this) {
+    switch (this->type) {
+        case FUNCTION:
+            if (this->ys == NULL) {
+                Contours_destroy(&this->contours);
+                break;
+            }
+            free(this->ys);
+            break;
+        case EQUATION:
+            plot_equation_free(this->grids, this->workers);
+            break;
+        case CONTOUR:
+        case TRACE:
+            Contours_destroy(&this->contours);
+            break;
+        default:
     }
+    Arena_free(&this->arena);
+}
+
+// Column of the pixels on the y axis, which may be outside the image
+int axis_column(int w) {
+    return w / 2 - (int)lround(center_x * scale);
+}
 
-    BMP_color *framebuffer = malloc(sizeof(BMP_color) * w * h);
-    memset(framebuffer, 255, sizeof(BMP_color) * w * h);
+// Row of the pixels on the x axis, which may be outside the image
+int axis_row(int h) {
+    return h / 2 - (int)lround(center_y * scale);
+}
 
+// Clears the band to the background with the axes and draws the plots into it
+void render_band(Band *band, Plot *plots, uint count) {
+    const int w = band->w;
+    const int y0 = band->y0;
+    const int ax = axis_column(w);
+    const int ay = axis_row(band->h);
     BMP_color clr_black = { 0, 0, 0 };
 
-    for (int x = 0; x < w; x++) {
-        framebuffer[(h / 2) * w + x] = clr_black;
+    for (int y = y0; y < y0 + band->rows; y++) {
+        memset(Band_pixel(band, 0, y), 255, sizeof(BMP_color) * w);
     }
-    
-    for (int y = 0; y < h; y++) {
-        framebuffer[y * w + (w / 2)] = clr_black;
+
+    if (ay >= y0 && ay < y0 + band->rows) {
+        for (int x = 0; x < w; x++) {
+            *Band_pixel(band, x, ay) = clr_black;
+        }
+    }
+    for (int y = y0; ax >= 0 && ax < w && y < y0 + band->rows; y++) {
+        *Band_pixel(band, ax, y) = clr_black;
+    }
+
+    for (uint i = 0; i < count; i++) {
+        Plot_band(&plots[i], band);
+    }
+}
+
+uint render_band_rows(int h) {
+    return band_rows > 0 && band_rows < h ? band_rows : h;
+}
+
+// Pixels of the bands render_bmp draws into, kept for the next image
+BMP_color *band_buffer = NULL;
+size_t band_capacity = 0;
+
+// Renders the plots band_rows rows at a time and writes each band as soon as it is done
+int render_bmp(FILE *out, Plot *plots, uint count, int w, int h) {
+    const int rows = render_band_rows(h);
+    if ((size_t)w * rows > band_capacity) {
+        free(band_buffer);
+        band_capacity = (size_t)w * rows;
+        band_buffer = malloc(sizeof(BMP_color) * band_capacity);
+    }
+    Band band = { band_buffer, sizeof(BMP_color) * w, w, h, 0, rows };
+
+    BMP_writer writer;
+    BMP_begin(&writer, out, w, h);
+
+    int ok = 1;
+    for (int y0 = 0; ok && y0 < h; y0 += rows) {
+        band.y0 = y0;
+        band.rows = y0 + rows < h ? rows : h - y0;
+        render_band(&band, plots, count);
+        ok = BMP_write_rows(&writer, band.pixels, band.rows);
+    }
+
+    return ok;
+}
+
+// Renders the plots straight into the mapped output file band by band, finished bands are
+// dropped from the resident set while the page cache writes them back.
+// Falls back to render_bmp if the file can't be mapped
+int render_mapped(FILE *out, Plot *plots, uint count, int w, int h) {
+    BMP_mapping mapping;
+    if (!BMP_map(&mapping, out, w, h)) {
+        fprintf(stderr, "Failed to map the output file, writing it in bands\n");
+        return render_bmp(out, plots, count, w, h);
+    }
+
+    const int rows = render_band_rows(h);
+    Band band = { mapping.pixels, mapping.stride, w, h, 0, rows };
+
+    for (int y0 = 0; y0 < h; y0 += rows) {
+        band.pixels = (BMP_color*)((char*)mapping.pixels + mapping.stride * y0);
+        band.y0 = y0;
+        band.rows = y0 + rows < h ? rows : h - y0;
+        BMP_advise(&mapping, y0, band.rows, MADV_WILLNEED);
+        render_band(&band, plots, count);
+        BMP_advise(&mapping, y0, band.rows, MADV_DONTNEED);
+    }
+
+    return BMP_unmap(&mapping);
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-b interpreter/compiled/batch/jit/cc] [-k auto/avx2/sse2/scalar] [-c cull block] [-t threads] [-r lattice/recursive/distance] [-w line width] [-f fixed/adaptive] [-g contour cells] [-s width x height] [-v x,y,scale] [-a variable,from,to,frames] [-l band rows] [-m] [-x] (output file) [F=/E=/C=/T=/B=](math expression)...\n", name);
+    fprintf(stderr, "       %s [options] -i (job file or -) / -u (socket path) [-p cached programs]\n", name);
+}
+
+// Everything the options of a job can change, batch mode puts it back after every job
+typedef struct {
+    enum Backend backend;
+    const VectorKernels *kernels;
+    int cull_block;
+    int threads;
+    int contour_cells;
+    int w;
+    int h;
+    int band_rows;
+    int map_output;
+    int tile_cache;
+    enum Refinement refinement;
+    enum Sampling sampling;
+    Value line_width;
+    Value scale;
+    Value center_x;
+    Value center_y;
+    int sweep_variable;
+    Value sweep_from;
+    Value sweep_to;
+    int sweep_frames;
+} Settings;
+
+Settings Settings_save() {
+    Settings this = {
+        backend, vector_kernels, cull_block, threads, contour_cells, w, h,
+        band_rows, map_output, tile_cache, refinement, sampling, line_width, scale, center_x, center_y,
+        sweep_variable, sweep_from, sweep_to, sweep_frames
+    };
+    return this;
+}
+
+void Settings_restore(const Settings *this) {
+    backend = this->backend;
+    vector_kernels = this->kernels;
+    cull_block = this->cull_block;
+    threads = this->threads;
+    contour_cells = this->contour_cells;
+    w = this->w;
+    h = this->h;
+    band_rows = this->band_rows;
+    map_output = this->map_output;
+    tile_cache = this->tile_cache;
+    refinement = this->refinement;
+    sampling = this->sampling;
+    line_width = this->line_width;
+    scale = this->scale;
+    center_x = this->center_x;
+    center_y = this->center_y;
+    sweep_variable = this->sweep_variable;
+    sweep_from = this->sweep_from;
+    sweep_to = this->sweep_to;
+    sweep_frames = this->sweep_frames;
+}
+
+// Parses the options of argv into the settings, optind is left at the first argument.
+// Returns 0 on invalid options
+int parse_options(int argc, const char **argv) {
+    int opt;
+    while ((opt = getopt(argc, (char* const*)argv, "+b:k:c:t:r:f:g:s:v:a:l:mxi:u:p:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (strcmp(optarg, "interpreter") == 0) {
+                    backend = BACKEND_INTERPRETER;
+                } else if (strcmp(optarg, "compiled") == 0) {
+                    backend = BACKEND_COMPILED;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    backend = BACKEND_BATCH;
+                } else if (strcmp(optarg, "jit") == 0) {
+                    backend = BACKEND_JIT;
+                } else if (strcmp(optarg, "cc") == 0) {
+                    backend = BACKEND_CC;
+                } else {
+                    fprintf(stderr, "Unknown backend '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'k':
+                if (!Vector_select(optarg)) {
+                    fprintf(stderr, "Vector kernels '%s' are unknown or not supported\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'c':
+                cull_block = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'g':
+                contour_cells = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+                    fprintf(stderr, "Invalid image size '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'v':
+                if (sscanf(optarg, "%lf,%lf,%lf", &center_x, &center_y, &scale) != 3 || !(scale > 0)) {
+                    fprintf(stderr, "Invalid viewport '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'a': {
+                char name;
+                State state;
+                State_init(&state);
+                if (sscanf(optarg, "%c,%lf,%lf,%d", &name, &sweep_from, &sweep_to, &sweep_frames) != 4
+                    || !((name >= 'a' && name <= 'z') || (name >= 'A' && name <= 'Z')) || name == 'x' || name == 'y' || state.vars[(int)name].constant
+                    || sweep_frames < 1) {
+                    fprintf(stderr, "Invalid sweep '%s'\n", optarg);
+                    return 0;
+                }
+                sweep_variable = name;
+                break;
+            }
+            case 'l':
+                band_rows = atoi(optarg);
+                break;
+            case 'w':
+                line_width = atof(optarg);
+                break;
+            case 'm':
+                map_output = 1;
+                break;
+            case 'x':
+                tile_cache = 1;
+                break;
+            case 'r':
+                if (strcmp(optarg, "lattice") == 0) {
+                    refinement = REFINEMENT_LATTICE;
+                } else if (strcmp(optarg, "recursive") == 0) {
+                    refinement = REFINEMENT_RECURSIVE;
+                } else if (strcmp(optarg, "distance") == 0) {
+                    refinement = REFINEMENT_DISTANCE;
+                } else {
+                    fprintf(stderr, "Unknown refinement '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "fixed") == 0) {
+                    sampling = SAMPLING_FIXED;
+                } else if (strcmp(optarg, "adaptive") == 0) {
+                    sampling = SAMPLING_ADAPTIVE;
+                } else {
+                    fprintf(stderr, "Unknown sampling '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'i':
+                batch_input = optarg;
+                break;
+            case 'u':
+                batch_socket = optarg;
+                break;
+            case 'p':
+                program_cache_size = atoi(optarg);
+                break;
+            default:
+                return 0;
+        }
     }
+    return 1;
+}
+
+// Renders the plots of sources into the file at path, returns 0 on failure
+int render_image(const char *path, const char **sources, uint count) {
+    const char *extension = strrchr(path, '.');
+    const int svg = extension && strcmp(extension, ".svg") == 0;
 
-    for (int i = 2; i < argc; i++) {
-        const char *source = argv[i];
+    Plot *plots = malloc(sizeof(Plot) * (count ? count : 1));
+    uint plot_count = 0;
+    color_index = 0;
+
+    // the image is only written if every plot could be prepared
+    int ok = 1;
+    for (uint i = 0; i < count; i++) {
+        const char *source = sources[i];
         enum PlotType type = FUNCTION;
-        if (source[1] == '=') {
+        if (source[0] && source[1] == '=') {
             switch (source[0]) {
                 case 'E':
-                    type = EQUATION;
+                    type = svg ? CONTOUR : EQUATION;
+                    break;
+                case 'C':
+                    type = CONTOUR;
+                    break;
+                case 'T':
+                    type = TRACE;
                     break;
                 case 'B':
                     type = BENCHMARK;
@@ -291,15 +2191,272 @@ int main(int argc, const char **argv) {
             }
             source += 2;
         }
-        plot_expression(type, source, framebuffer, w, h);
+        if (Plot_init(&plots[plot_count], type, source, w, h)) {
+            plot_count++;
+        } else if (type != BENCHMARK) {
+            // benchmarks never leave a plot behind
+            fprintf(stderr, "Failed to plot '%s'\n", source);
+            ok = 0;
+        }
+    }
+
+    FILE *out = NULL;
+    if (ok) {
+        out = fopen(path, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Failed to open file for writing\n");
+            ok = 0;
+        }
+    }
+
+    if (ok && svg) {
+        SVG_begin(out, w, h);
+        SVG_line(out, 0, h - (axis_row(h) + 0.5), w, h - (axis_row(h) + 0.5), 0, 0, 0);
+        SVG_line(out, axis_column(w) + 0.5, 0, axis_column(w) + 0.5, h, 0, 0, 0);
+        for (uint i = 0; i < plot_count; i++) {
+            Plot_svg(&plots[i], out, w, h);
+        }
+        SVG_end(out);
+        ok = !ferror(out);
+    } else if (ok) {
+        ok = (map_output ? render_mapped : render_bmp)(out, plots, plot_count, w, h);
+    }
+    if (out && fclose(out) != 0) {
+        ok = 0;
+    }
+    if (out && !ok) {
+        fprintf(stderr, "Failed to write image\n");
+    }
+
+    for (uint i = 0; i < plot_count; i++) {
+        Plot_destroy(&plots[i]);
+    }
+    free(plots);
+    return ok;
+}
+
+// Path of frame out of frames, its zero padded number goes before the extension of path
+char *frame_path(const char *path, uint frame, uint frames) {
+    int digits = 1;
+    for (uint n = frames - 1; n >= 10; n /= 10) {
+        digits++;
+    }
+    const char *extension = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (extension == NULL || (slash && slash > extension)) {
+        extension = path + strlen(path);
+    }
+    char *result = malloc(strlen(path) + 16);
+    sprintf(result, "%.*s-%0*u%s", (int)(extension - path), path, digits, frame, extension);
+    return result;
+}
+
+int render_frame(const char *path, const char **sources, uint count, uint frame, uint frames) {
+    sweep_value = frames > 1 ? sweep_from + (sweep_to - sweep_from) * frame / (frames - 1) : sweep_from;
+    char *frame_file = frame_path(path, frame, frames);
+    fprintf(stderr, "Frame %u of %u: %c = %g\n", frame + 1, frames, sweep_variable, sweep_value);
+    const int ok = render_image(frame_file, sources, count);
+    free(frame_file);
+    return ok;
+}
+
+// Renders sweep_frames numbered images with sweep_variable going from sweep_from to sweep_to.
+// The first frame leaves the compiled programs in the program cache and the other frames are
+// spread over forked processes that reuse them, each with a share of the threads.
+// Returns 0 if any frame failed
+int render_sweep(const char *path, const char **sources, uint count) {
+    const uint frames = sweep_frames;
+    ProgramCache *own = NULL;
+    if (program_cache == NULL) {
+        own = program_cache = ProgramCache_create(count > 0 ? count : 1);
+    }
+
+    int ok = render_frame(path, sources, count, 0, frames);
+
+    uint processes = plot_threads();
+    if (processes > frames - 1) {
+        processes = frames - 1;
+    }
+    const int saved_threads = threads;
+    const uint share = plot_threads() / (processes ? processes : 1);
+    pid_t *children = malloc(sizeof(pid_t) * (processes ? processes : 1));
+
+    fflush(stdout);
+    fflush(stderr);
+    for (uint k = 0; k < processes; k++) {
+        children[k] = fork();
+        if (children[k] == 0) {
+            threads = share > 0 ? share : 1;
+            int child_ok = 1;
+            for (uint frame = 1 + k; frame < frames; frame += processes) {
+                child_ok &= render_frame(path, sources, count, frame, frames);
+            }
+            fflush(stderr);
+            _exit(!child_ok);
+        }
+        if (children[k] < 0) {
+            // render the share of a process that couldn't be started here
+            threads = share > 0 ? share : 1;
+            for (uint frame = 1 + k; frame < frames; frame += processes) {
+                ok &= render_frame(path, sources, count, frame, frames);
+            }
+            threads = saved_threads;
+        }
+    }
+    for (uint k = 0; k < processes; k++) {
+        int status;
+        if (children[k] > 0 && (waitpid(children[k], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            ok = 0;
+        }
+    }
+    free(children);
+
+    if (own) {
+        ProgramCache_free(own);
+        program_cache = NULL;
+    }
+    return ok;
+}
+
+#define JOB_MAX_ARGS 256
+
+// Splits line into arguments at whitespace outside parentheses, so expressions need no quoting.
+// Returns the number of arguments
+uint split_job(char *line, const char **args, uint max) {
+    uint count = 0;
+    char *p = line;
+    while (count < max) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        args[count++] = p;
+        int depth = 0;
+        for (; *p && (depth > 0 || !(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')); p++) {
+            depth += (*p == '(') - (*p == ')');
+        }
+        if (*p) {
+            *p++ = '\0';
+        }
+    }
+    return count;
+}
+
+// Renders the jobs read from in, one per line with the arguments of a command line, and
+// answers every job on out with "ok" or "error" followed by its output file, or - if it has none. Options of a job
+// only apply to that job
+void run_jobs(FILE *in, FILE *out) {
+    char *line = NULL;
+    size_t length = 0;
+    const char *args[JOB_MAX_ARGS + 1];
+
+    while (getline(&line, &length, in) != -1) {
+        args[0] = "job";
+        const uint count = split_job(line, args + 1, JOB_MAX_ARGS) + 1;
+        if (count == 1 || args[1][0] == '#') {
+            continue;
+        }
+
+        Settings settings = Settings_save();
+        optind = 0;
+        const int parsed = parse_options(count, args) && optind + 1 < (int)count;
+        int ok = 0;
+        if (parsed) {
+            ok = (sweep_frames > 0 ? render_sweep : render_image)(args[optind], args + optind + 1, count - optind - 1);
+        } else {
+            fprintf(stderr, "Invalid job\n");
+        }
+        Settings_restore(&settings);
+
+        fprintf(out, "%s %s\n", ok ? "ok" : "error", parsed ? args[optind] : "-");
+        fflush(out);
+    }
+    free(line);
+}
+
+// Serves one connection at a time on a UNIX socket at path, each connection sends jobs
+// like a job file and gets the answers back. Returns 0 if the socket can't be set up
+int serve_jobs(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server < 0 || bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+        fprintf(stderr, "Failed to listen on '%s'\n", path);
+        if (server >= 0) {
+            close(server);
+        }
+        return 0;
     }
 
-    BMP_create(out, w, h, framebuffer);
+    // a client hanging up early must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Listening on %s\n", path);
 
-    cleanup:;
-    if (out != NULL) {
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+        run_jobs(in, out);
         fclose(out);
+        fclose(in);
+    }
+
+    close(server);
+    unlink(path);
+    return 1;
+}
+
+int main(int argc, const char **argv) {
+    if (!parse_options(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (batch_input || batch_socket) {
+        program_cache = ProgramCache_create(program_cache_size > 0 ? program_cache_size : 0);
+        int ok = 1;
+        if (batch_socket) {
+            ok = serve_jobs(batch_socket);
+        } else if (strcmp(batch_input, "-") == 0) {
+            run_jobs(stdin, stdout);
+        } else {
+            FILE *in = fopen(batch_input, "r");
+            if (in == NULL) {
+                fprintf(stderr, "Failed to open job file '%s'\n", batch_input);
+                ok = 0;
+            } else {
+                run_jobs(in, stdout);
+                fclose(in);
+            }
+        }
+        fprintf(stderr, "Program cache: %lu hits, %lu misses\n", program_cache->hits, program_cache->misses);
+        ProgramCache_free(program_cache);
+        free(band_buffer);
+        return !ok;
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
     }
-    return code;
 
-}
\ No newline at end of file
+    int code = !(sweep_frames > 0 ? render_sweep : render_image)(argv[optind], argv + optind + 1, argc - optind - 1);
+    free(band_buffer);
+    return code;
+}
@@ -1,8 +1,63 @@
+enum Backend {
+    BACKEND_INTERPRETER, BACKEND_COMPILED, BACKEND_BATCH, BACKEND_JIT, BACKEND_CC
+};
+
+enum Refinement {
+    REFINEMENT_LATTICE, REFINEMENT_RECURSIVE, REFINEMENT_DISTANCE
+};
+
+enum Sampling {
+    SAMPLING_FIXED, SAMPLING_ADAPTIVE
+};
+
 int step = 1;
 int size = 1;
 int w = 1024;
 int h = 1024;
+// rows of the image rendered and written to a bmp at a time, 0 renders the whole image at once
+int band_rows = 256;
+// render straight into the mmapped output file instead of writing out bands
+int map_output = 0;
 Value scale = 256;
+// point of the plane at the centre of the image
+Value center_x = 0;
+Value center_y = 0;
 Value treshold = 0.01;
 Value treshold_multiplier = 0.1;
-int max_depth = 8;
\ No newline at end of file
+int max_depth = 8;
+// equation pixels are refined on a shared lattice of 2^lattice_depth cells per side,
+// or per pixel down to max_depth with recursive refinement. Distance refinement covers pixels
+// by their distance to the curve estimated from one evaluation of the gradient
+enum Refinement refinement = REFINEMENT_LATTICE;
+int lattice_depth = 3;
+// functions are sampled at every step'th column and drawn as dots, or adaptively where the
+// curve bends or jumps and drawn as lines
+enum Sampling sampling = SAMPLING_ADAPTIVE;
+// width in pixels of equations drawn with distance refinement
+Value line_width = 1;
+// cells across the image of the grid contours are extracted from
+int contour_cells = 256;
+// side of the sample blocks plot_equation stops subdividing at, 0 disables interval culling
+int cull_block = 8;
+// side of the square tiles of samples rendered by each worker task
+int tile_size = 32;
+// render threads, 0 uses every online cpu
+int threads = 0;
+enum Backend backend = BACKEND_BATCH;
+// where libraries built by the cc backend are kept, NULL uses $XDG_CACHE_HOME/plotter
+// or ~/.cache/plotter
+const char *cache_directory = NULL;
+// equation tiles are kept in the tiles directory of the cache and loaded by later renders
+// of the same expression and settings instead of being evaluated again
+int tile_cache = 0;
+// batch mode reads jobs from this file, - for stdin, or from connections to this socket
+const char *batch_input = NULL;
+const char *batch_socket = NULL;
+// compiled programs batch mode keeps for later jobs
+int program_cache_size = 64;
+// sweep_frames numbered images are rendered with sweep_variable going from sweep_from to
+// sweep_to, 0 frames renders one image without it
+int sweep_variable = 0;
+Value sweep_from = 0;
+Value sweep_to = 1;
+int sweep_frames = 0;
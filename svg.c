@@ -0,0 +1,31 @@
+#include <stdio.h>
+
+// Minimal SVG writer, coordinates are in pixels with y pointing down
+
+void SVG_begin(FILE *out, int w, int h) {
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\">\n", w, h, w, h);
+    fprintf(out, "<rect width=\"%d\" height=\"%d\" fill=\"white\"/>\n", w, h);
+}
+
+void SVG_end(FILE *out) {
+    fprintf(out, "</svg>\n");
+}
+
+void SVG_line(FILE *out, double x0, double y0, double x1, double y1, int red, int green, int blue) {
+    fprintf(out, "<line x1=\"%.3f\" y1=\"%.3f\" x2=\"%.3f\" y2=\"%.3f\" stroke=\"rgb(%d,%d,%d)\" stroke-width=\"1\"/>\n",
+        x0, y0, x1, y1, red, green, blue);
+}
+
+// Starts a polyline, add its points with SVG_point and finish it with SVG_polyline_end
+void SVG_polyline_begin(FILE *out, int red, int green, int blue) {
+    fprintf(out, "<polyline fill=\"none\" stroke=\"rgb(%d,%d,%d)\" stroke-width=\"1\" stroke-linejoin=\"round\" points=\"", red, green, blue);
+}
+
+void SVG_point(FILE *out, double x, double y) {
+    fprintf(out, "%.3f,%.3f ", x, y);
+}
+
+void SVG_polyline_end(FILE *out) {
+    fprintf(out, "\"/>\n");
+}
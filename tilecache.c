@@ -0,0 +1,130 @@
+// Tiles of pixel coverage kept on disk, each file is named after a hash of a key that spells out
+// everything the tile depends on. Files hold the key followed by the nonzero values, a file whose
+// key doesn't match, like a hash collision, counts as a miss
+
+#include <stdint.h>
+
+#define TILE_CACHE_MAGIC "plotter tile 1\n"
+
+typedef struct {
+    char *directory;
+    // start of the keys of every tile, the rest is the extent of the tile
+    char *prefix;
+} TileCache;
+
+typedef struct {
+    uint32_t index;
+    double value;
+} TileCacheEntry;
+
+// Takes over prefix, returns NULL if the tile directory under directory can't be created
+TileCache *TileCache_create(const char *directory, char *prefix) {
+    char *path = malloc(strlen(directory) + 8);
+    sprintf(path, "%s/tiles", directory);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        free(path);
+        free(prefix);
+        return NULL;
+    }
+    TileCache *this = malloc(sizeof(TileCache));
+    this->directory = path;
+    this->prefix = prefix;
+    return this;
+}
+
+void TileCache_free(TileCache *this) {
+    free(this->directory);
+    free(this->prefix);
+    free(this);
+}
+
+// Key of the tile of samples [c0, c1) x [r0, r1), numbered from the origin of the plane
+char *TileCache_key(const TileCache *this, long c0, long c1, long r0, long r1) {
+    char *key = malloc(strlen(this->prefix) + 96);
+    sprintf(key, "%s\n%ld %ld %ld %ld", this->prefix, c0, c1, r0, r1);
+    return key;
+}
+
+char *TileCache_path(const TileCache *this, const char *key) {
+    const uint64_t hash = Codegen_hash(0xcbf29ce484222325, key);
+    char *path = malloc(strlen(this->directory) + 32);
+    sprintf(path, "%s/%016llx.tile", this->directory, (unsigned long long)hash);
+    return path;
+}
+
+// Loads the tile of key into the columns x rows values at alpha, column i starting at
+// alpha + i * stride. Returns 0 and leaves alpha alone if the tile isn't cached
+int TileCache_load(const TileCache *this, const char *key, double *alpha, uint columns, uint rows, size_t stride) {
+    char *path = TileCache_path(this, key);
+    FILE *in = fopen(path, "rb");
+    free(path);
+    if (in == NULL) {
+        return 0;
+    }
+
+    const size_t magic = strlen(TILE_CACHE_MAGIC);
+    const size_t length = strlen(key);
+    char *header = malloc(magic + length + 1);
+    uint32_t stored, count;
+    int ok = fread(header, 1, magic, in) == magic && memcmp(header, TILE_CACHE_MAGIC, magic) == 0
+        && fread(&stored, sizeof(stored), 1, in) == 1 && stored == length
+        && fread(header, 1, length, in) == length && memcmp(header, key, length) == 0
+        && fread(&count, sizeof(count), 1, in) == 1 && count <= columns * rows;
+    free(header);
+
+    TileCacheEntry *entries = NULL;
+    if (ok) {
+        entries = malloc(sizeof(TileCacheEntry) * (count ? count : 1));
+        ok = fread(entries, sizeof(TileCacheEntry), count, in) == count;
+        for (uint i = 0; ok && i < count; i++) {
+            ok = entries[i].index < columns * rows;
+        }
+    }
+    fclose(in);
+
+    if (ok) {
+        for (uint i = 0; i < count; i++) {
+            alpha[entries[i].index / rows * stride + entries[i].index % rows] = entries[i].value;
+        }
+    }
+    free(entries);
+    return ok;
+}
+
+// Writes the tile laid out like in TileCache_load, under a temporary name that is renamed
+// so concurrent renders never read a partial file. unique tells writers of one process apart
+void TileCache_store(const TileCache *this, const char *key, const double *alpha, uint columns, uint rows, size_t stride, uint unique) {
+    // zeroed so the padding of entries is written deterministically
+    TileCacheEntry *entries = calloc(columns * rows, sizeof(TileCacheEntry));
+    uint32_t count = 0;
+    for (uint c = 0; c < columns; c++) {
+        for (uint r = 0; r < rows; r++) {
+            const double value = alpha[c * stride + r];
+            if (value != 0) {
+                entries[count].index = c * rows + r;
+                entries[count].value = value;
+                count++;
+            }
+        }
+    }
+
+    char *path = TileCache_path(this, key);
+    char *temporary = malloc(strlen(path) + 32);
+    sprintf(temporary, "%s.%ld.%u", path, (long)getpid(), unique);
+    FILE *out = fopen(temporary, "wb");
+    if (out) {
+        const uint32_t length = strlen(key);
+        int ok = fwrite(TILE_CACHE_MAGIC, 1, strlen(TILE_CACHE_MAGIC), out) == strlen(TILE_CACHE_MAGIC)
+            && fwrite(&length, sizeof(length), 1, out) == 1
+            && fwrite(key, 1, length, out) == length
+            && fwrite(&count, sizeof(count), 1, out) == 1
+            && fwrite(entries, sizeof(TileCacheEntry), count, out) == count;
+        ok &= fclose(out) == 0;
+        if (!ok || rename(temporary, path) != 0) {
+            unlink(temporary);
+        }
+    }
+    free(temporary);
+    free(path);
+    free(entries);
+}
@@ -0,0 +1,292 @@
+// Follows the zero set of an implicit function from seed points with predictor-corrector
+// steps: a step along the tangent is pulled back onto the curve with Newton iterations. The
+// number of evaluations grows with the length of the curve rather than with the area of the
+// image. Everything is in pixel space, the function returns its value with the gradient in
+// pixels. Curves end where they leave the image, run into a curve already traced or reach a
+// point the steps can't get past, like a crossing where the gradient vanishes
+
+#include <stdint.h>
+
+typedef Dual (*TraceFunction)(void *context, Value x, Value y);
+
+// distance from the curve in pixels at which a point counts as on it
+#define TRACE_TOLERANCE 0.02
+#define TRACE_MAX_STEP 1.0
+#define TRACE_MIN_STEP (1.0 / 64)
+#define TRACE_CORRECTIONS 4
+#define TRACE_SEED_CORRECTIONS 12
+// cosine of the largest turn between the tangents at the ends of a step
+#define TRACE_MAX_TURN 0.9
+// marks left by the current curve within this many steps don't stop it
+#define TRACE_RECENT 8
+
+#define TRACE_EMPTY UINT64_MAX
+
+// Pixel key of a point on a traced curve, with the curve and step that reached it first
+typedef struct {
+    uint64_t key;
+    uint curve;
+    uint step;
+} TraceMark;
+
+typedef struct {
+    ContourPoint *points;
+    uint length;
+    uint capacity;
+} TraceBuffer;
+
+typedef struct {
+    TraceFunction function;
+    void *context;
+    Value w;
+    Value h;
+    unsigned long evaluations;
+
+    TraceMark *marks;
+    uint mark_count;
+    uint mark_capacity;
+
+    // finished curves, curve k spans points[offsets[k]] up to points[offsets[k + 1]]
+    TraceBuffer output;
+    uint *offsets;
+    uint curve_count;
+    uint offset_capacity;
+    // points of the curve traced backwards from its seed
+    TraceBuffer back;
+    uint step;
+} Tracer;
+
+typedef enum {
+    TRACE_CLOSED, TRACE_STOPPED
+} ETraceEnd;
+
+void TraceBuffer_push(TraceBuffer *this, ContourPoint point) {
+    if (this->length == this->capacity) {
+        this->capacity = this->capacity ? this->capacity * 2 : 256;
+        this->points = realloc(this->points, sizeof(ContourPoint) * this->capacity);
+    }
+    this->points[this->length++] = point;
+}
+
+void Tracer_init(Tracer *this, TraceFunction function, void *context, Value w, Value h) {
+    memset(this, 0, sizeof(Tracer));
+    this->function = function;
+    this->context = context;
+    this->w = w;
+    this->h = h;
+}
+
+// Coordinates are biased by 2^31 so pixels next to the image, like (-1, -1), never encode to
+// TRACE_EMPTY, only a pixel far outside of any image does
+uint64_t Tracer_key(ContourPoint point) {
+    const uint64_t x = (uint32_t)((int64_t)floor(point.x) + 0x80000000LL);
+    const uint64_t y = (uint32_t)((int64_t)floor(point.y) + 0x80000000LL);
+    return x << 32 | y;
+}
+
+uint Tracer_hash(uint64_t key) {
+    return (uint)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+// Slot of the mark of key, or the empty slot where it belongs
+TraceMark *Tracer_find(Tracer *this, uint64_t key) {
+    const uint mask = this->mark_capacity - 1;
+    for (uint i = Tracer_hash(key) & mask; ; i = (i + 1) & mask) {
+        TraceMark *mark = &this->marks[i];
+        if (mark->key == key || mark->key == TRACE_EMPTY) {
+            return mark;
+        }
+    }
+}
+
+// Marks the pixel of point unless it is marked, returns its mark
+TraceMark Tracer_mark(Tracer *this, ContourPoint point, uint curve) {
+    if ((this->mark_count + 1) * 2 > this->mark_capacity) {
+        TraceMark *marks = this->marks;
+        const uint capacity = this->mark_capacity;
+        this->mark_capacity = capacity ? capacity * 2 : 1024;
+        this->marks = malloc(sizeof(TraceMark) * this->mark_capacity);
+        for (uint i = 0; i < this->mark_capacity; i++) {
+            this->marks[i].key = TRACE_EMPTY;
+        }
+        for (uint i = 0; i < capacity; i++) {
+            if (marks[i].key != TRACE_EMPTY) {
+                *Tracer_find(this, marks[i].key) = marks[i];
+            }
+        }
+        free(marks);
+    }
+
+    const uint64_t key = Tracer_key(point);
+    TraceMark *mark = Tracer_find(this, key);
+    if (mark->key == TRACE_EMPTY) {
+        mark->key = key;
+        mark->curve = curve;
+        mark->step = this->step;
+        this->mark_count++;
+    }
+    return *mark;
+}
+
+// Whether a pixel next to point or its own is marked
+int Tracer_near_mark(Tracer *this, ContourPoint point) {
+    if (this->mark_count == 0) {
+        return 0;
+    }
+    for (int i = -1; i <= 1; i++) {
+        for (int j = -1; j <= 1; j++) {
+            ContourPoint neighbour = { point.x + i, point.y + j };
+            if (Tracer_find(this, Tracer_key(neighbour))->key != TRACE_EMPTY) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+Dual Tracer_evaluate(Tracer *this, ContourPoint point) {
+    this->evaluations++;
+    return this->function(this->context, point.x, point.y);
+}
+
+// Moves point onto the curve with up to iterations Newton steps along the gradient, failing
+// if it would move further than limit. f is left with the value and gradient at the result
+int Tracer_project(Tracer *this, ContourPoint *point, Dual *f, uint iterations, Value limit) {
+    const ContourPoint start = *point;
+    for (uint i = 0; i <= iterations; i++) {
+        *f = Tracer_evaluate(this, *point);
+        const Value g2 = f->dx * f->dx + f->dy * f->dy;
+        if (!isfinite(f->v) || !(g2 > 0) || !isfinite(g2)) {
+            return 0;
+        }
+        if (Value_fabs(f->v) <= TRACE_TOLERANCE * sqrt(g2)) {
+            return 1;
+        }
+        if (i == iterations) {
+            return 0;
+        }
+        point->x -= f->v * f->dx / g2;
+        point->y -= f->v * f->dy / g2;
+        const Value dx = point->x - start.x;
+        const Value dy = point->y - start.y;
+        if (dx * dx + dy * dy > limit * limit) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Unit tangent of the curve at a point with gradient f, pointing the same way as previous
+ContourPoint Tracer_tangent(Dual f, ContourPoint previous) {
+    const Value length = sqrt(f.dx * f.dx + f.dy * f.dy);
+    ContourPoint tangent = { -f.dy / length, f.dx / length };
+    if (tangent.x * previous.x + tangent.y * previous.y < 0) {
+        tangent.x = -tangent.x;
+        tangent.y = -tangent.y;
+    }
+    return tangent;
+}
+
+// Follows the curve from start, where the gradient is f, in direction and appends the points
+// reached to buffer. The curve is closed when it comes back to start
+ETraceEnd Tracer_follow(Tracer *this, TraceBuffer *buffer, ContourPoint start, Dual f, ContourPoint direction, uint curve) {
+    ContourPoint point = start;
+    ContourPoint tangent = Tracer_tangent(f, direction);
+    Value step = TRACE_MAX_STEP;
+    Value travelled = 0;
+    const unsigned long limit = (unsigned long)((this->w + this->h) * 64);
+
+    for (unsigned long steps = 0; steps < limit; steps++) {
+        ContourPoint next = { point.x + tangent.x * step, point.y + tangent.y * step };
+        Dual g;
+        int ok = Tracer_project(this, &next, &g, TRACE_CORRECTIONS, step * 0.5);
+        ContourPoint next_tangent;
+        if (ok) {
+            next_tangent = Tracer_tangent(g, tangent);
+            ok = next_tangent.x * tangent.x + next_tangent.y * tangent.y >= TRACE_MAX_TURN;
+        }
+        if (!ok) {
+            step *= 0.5;
+            if (step < TRACE_MIN_STEP) {
+                return TRACE_STOPPED;
+            }
+            continue;
+        }
+
+        const Value dx = next.x - start.x;
+        const Value dy = next.y - start.y;
+        travelled += step;
+        point = next;
+        tangent = next_tangent;
+        this->step++;
+
+        if (travelled > 3 && dx * dx + dy * dy < 1) {
+            TraceBuffer_push(buffer, point);
+            TraceBuffer_push(buffer, start);
+            return TRACE_CLOSED;
+        }
+
+        TraceBuffer_push(buffer, point);
+        if (point.x < -1 || point.y < -1 || point.x > this->w + 1 || point.y > this->h + 1) {
+            return TRACE_STOPPED;
+        }
+
+        const TraceMark mark = Tracer_mark(this, point, curve);
+        if (mark.curve != curve || (this->step - mark.step > TRACE_RECENT && travelled > 3)) {
+            return TRACE_STOPPED;
+        }
+
+        if (step < TRACE_MAX_STEP) {
+            step *= 2;
+        }
+    }
+    return TRACE_STOPPED;
+}
+
+// Traces the curve through the zero crossing near seed both ways, unless the crossing is
+// further than limit or already on a traced curve
+void Tracer_trace(Tracer *this, ContourPoint seed, Value limit) {
+    Dual f;
+    if (!Tracer_project(this, &seed, &f, TRACE_SEED_CORRECTIONS, limit) || Tracer_near_mark(this, seed)) {
+        return;
+    }
+
+    const uint curve = this->curve_count;
+    this->step++;
+    Tracer_mark(this, seed, curve);
+
+    ContourPoint forward = { 1, 0 };
+    forward = Tracer_tangent(f, forward);
+    ContourPoint backward = { -forward.x, -forward.y };
+
+    this->back.length = 0;
+    const ETraceEnd end = Tracer_follow(this, &this->back, seed, f, backward, curve);
+
+    if (this->curve_count + 2 > this->offset_capacity) {
+        this->offset_capacity = this->offset_capacity ? this->offset_capacity * 2 : 64;
+        this->offsets = realloc(this->offsets, sizeof(uint) * this->offset_capacity);
+    }
+    this->offsets[this->curve_count++] = this->output.length;
+
+    for (uint i = this->back.length; i-- > 0;) {
+        TraceBuffer_push(&this->output, this->back.points[i]);
+    }
+    TraceBuffer_push(&this->output, seed);
+    if (end != TRACE_CLOSED) {
+        Tracer_follow(this, &this->output, seed, f, forward, curve);
+    }
+    this->offsets[this->curve_count] = this->output.length;
+}
+
+// Hands the traced curves over to contours as its polylines
+void Tracer_finish(Tracer *this, Contours *contours) {
+    memset(contours, 0, sizeof(Contours));
+    contours->polyline_count = this->curve_count;
+    contours->polylines = this->output.points;
+    contours->offsets = this->offsets;
+    if (this->offsets == NULL) {
+        contours->offsets = calloc(1, sizeof(uint));
+    }
+    free(this->back.points);
+    free(this->marks);
+}
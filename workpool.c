@@ -0,0 +1,142 @@
+// Runs a fixed set of tasks on a pool of threads. Every worker starts with a contiguous
+// range of tasks and takes them front to back, a worker that runs out steals the back
+// half of the largest remaining range so uneven tasks don't leave threads idle
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef void (*WorkPool_task)(void *context, uint worker, uint task);
+
+// Tasks [next, end) not yet taken
+typedef struct {
+    pthread_mutex_t lock;
+    uint next;
+    uint end;
+} WorkQueue;
+
+typedef struct {
+    WorkPool_task task;
+    void *context;
+    uint workers;
+    WorkQueue *queues;
+} WorkPool;
+
+typedef struct {
+    WorkPool *pool;
+    uint worker;
+} WorkPool_worker;
+
+// Number of threads to use when none is configured
+uint WorkPool_default_threads() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint)count : 1;
+}
+
+int WorkQueue_take(WorkQueue *this, uint *task) {
+    pthread_mutex_lock(&this->lock);
+    int taken = this->next < this->end;
+    if (taken) {
+        *task = this->next++;
+    }
+    pthread_mutex_unlock(&this->lock);
+    return taken;
+}
+
+// Moves the back half of the fullest other queue into the worker's own
+int WorkPool_steal(WorkPool *this, uint worker) {
+    WorkQueue *own = &this->queues[worker];
+
+    for (;;) {
+        uint victim = worker;
+        uint most = 0;
+        for (uint i = 0; i < this->workers; i++) {
+            if (i == worker) {
+                continue;
+            }
+            WorkQueue *queue = &this->queues[i];
+            pthread_mutex_lock(&queue->lock);
+            uint left = queue->end - queue->next;
+            pthread_mutex_unlock(&queue->lock);
+            if (left > most) {
+                victim = i;
+                most = left;
+            }
+        }
+        if (victim == worker) {
+            return 0;
+        }
+
+        WorkQueue *queue = &this->queues[victim];
+        uint begin = 0, end = 0;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next < queue->end) {
+            end = queue->end;
+            begin = end - (end - queue->next + 1) / 2;
+            queue->end = begin;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (begin < end) {
+            pthread_mutex_lock(&own->lock);
+            own->next = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+}
+
+void *WorkPool_run_worker(void *vworker) {
+    WorkPool_worker *worker = vworker;
+    WorkPool *this = worker->pool;
+
+    uint task;
+    do {
+        while (WorkQueue_take(&this->queues[worker->worker], &task)) {
+            this->task(this->context, worker->worker, task);
+        }
+    } while (WorkPool_steal(this, worker->worker));
+
+    return NULL;
+}
+
+// Calls task(context, worker, i) for every i in [0, tasks) on workers threads, worker 0 is the
+// calling thread. Returns once all tasks are done
+void WorkPool_run(uint workers, uint tasks, WorkPool_task task, void *context) {
+    if (workers > tasks) {
+        workers = tasks;
+    }
+    if (workers <= 1) {
+        for (uint i = 0; i < tasks; i++) {
+            task(context, 0, i);
+        }
+        return;
+    }
+
+    WorkPool pool = { task, context, workers, malloc(sizeof(WorkQueue) * workers) };
+    WorkPool_worker *states = malloc(sizeof(WorkPool_worker) * workers);
+    pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+
+    for (uint i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].next = (uint)((unsigned long)tasks * i / workers);
+        pool.queues[i].end = (uint)((unsigned long)tasks * (i + 1) / workers);
+        states[i].pool = &pool;
+        states[i].worker = i;
+    }
+
+    for (uint i = 1; i < workers; i++) {
+        pthread_create(&threads[i], NULL, WorkPool_run_worker, &states[i]);
+    }
+    WorkPool_run_worker(&states[0]);
+    for (uint i = 1; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(threads);
+    free(states);
+    free(pool.queues);
+}